@@ -0,0 +1,361 @@
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QProcess>
+#include <QStringList>
+#include <QTextStream>
+#include <QVector>
+#include <algorithm>
+#include "computegridcommons.hpp"
+#include "processtransport.hpp"
+#include "networkbench.h"
+#ifdef Q_OS_WIN
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <unistd.h>
+#endif
+
+using namespace ComputeGrid;
+
+// computegridbench transport [messages] [payloadBytes]
+//   Starts a copy of itself as the child process and pumps messages to it, once over the pipe with binary
+//   framing and once through the shared-memory ring: one way for throughput, then ping-pong for latency.
+// computegridbench network [messages] [payloadBytes] [port]
+//   Sends the messages over a loopback connection one packet each, then packed into 16 KB and 64 KB batches.
+// computegridbench -child [-shm key]
+//   The child side: counts PC_WORKER_DATA, answers PC_STATUS_MESSAGE with the count, echoes PC_TASK as PC_TASK_RESULT.
+
+static QTextStream out(stdout);
+
+static int readStdIn(char * _buffer, int _size)
+{
+#ifdef Q_OS_WIN
+	return _read(0, _buffer, _size);
+#else
+	return (int)::read(0, _buffer, _size);
+#endif
+}
+
+static void writeStdOut(const QByteArray & _data)
+{
+	for (int pos = 0; pos < _data.size();)
+	{
+#ifdef Q_OS_WIN
+		int n = _write(1, _data.constData() + pos, _data.size() - pos);
+#else
+		int n = (int)::write(1, _data.constData() + pos, _data.size() - pos);
+#endif
+		if (n <= 0)
+			return;
+
+		pos += n;
+	}
+}
+
+static int runChild(const QString & _shmKey)
+{
+#ifdef Q_OS_WIN
+	_setmode(0, _O_BINARY);
+	_setmode(1, _O_BINARY);
+#endif
+
+	ProcessTransport * transport = nullptr;
+	QByteArray pipeOut;
+
+	if (!_shmKey.isEmpty())
+	{
+		transport = new ProcessTransport(_shmKey, false);
+		if (!transport->open())
+			return 1;
+
+		transport->activate(pipeOut);
+	}
+
+	QByteArray buffer;
+	quint64 received = 0;
+	static char block[64 * 1024];
+
+	while (true)
+	{
+		if (!pipeOut.isEmpty())
+		{
+			writeStdOut(pipeOut);
+			pipeOut.clear();
+		}
+
+		int n = readStdIn(block, sizeof(block));
+		if (n <= 0)
+			break;
+
+		buffer.append(block, n);
+
+		QList<ProcessMessage> pipeMessages, messages;
+		ComputeGridGlobals::parseProcessMessages(buffer, pipeMessages);
+		if (transport)
+			transport->receive(pipeMessages, messages, pipeOut);
+		else
+			messages = pipeMessages;
+
+		for (QList<ProcessMessage>::iterator it = messages.begin(); it != messages.end(); ++it)
+		{
+			QByteArray reply;
+
+			if ((*it).command == PC_WORKER_DATA)
+				++received;
+			else if ((*it).command == PC_TASK)
+				reply = ComputeGridGlobals::makeProcessFrame(PC_TASK_RESULT, (*it).args, (*it).data);
+			else if ((*it).command == PC_STATUS_MESSAGE)
+			{
+				reply = ComputeGridGlobals::makeProcessFrame(PC_STATUS_MESSAGE, QStringList() << QString::number(received));
+				received = 0;
+			}
+			else if ((*it).command == PC_WORKER_EXIT)
+			{
+				delete transport;
+				return 0;
+			}
+
+			if (reply.isEmpty())
+				continue;
+
+			if (transport)
+				transport->send(reply, pipeOut);
+			else
+				pipeOut.append(reply);
+		}
+	}
+
+	delete transport;
+	return 0;
+}
+
+// The host end of one child, driven with the blocking QProcess calls.
+class BenchLink
+{
+public:
+	BenchLink(bool _sharedMemory)
+		: mTransport(nullptr)
+	{
+		QStringList args;
+		args << "-child";
+
+		if (_sharedMemory)
+		{
+			mTransport = new ProcessTransport(QString("computegridbench_%1").arg(QCoreApplication::applicationPid()), true);
+			if (mTransport->open())
+				args << "-shm" << mTransport->key();
+			else
+			{
+				delete mTransport;
+				mTransport = nullptr;
+			}
+		}
+
+		mProcess.start(QCoreApplication::applicationFilePath(), args);
+		mProcess.waitForStarted();
+
+		// the child announces its ring first, the host answers with its own
+		while (mTransport && !mTransport->isOutboundActive() && poll())
+		{
+		}
+	}
+
+	~BenchLink()
+	{
+		write(PC_WORKER_EXIT);
+		mProcess.closeWriteChannel();
+		mProcess.waitForFinished();
+		delete mTransport;
+	}
+
+	bool isValid()
+	{
+		return mProcess.state() == QProcess::Running && (!mTransport || mTransport->isOutboundActive());
+	}
+
+	QString name() const
+	{
+		return mTransport ? "shm" : "pipe";
+	}
+
+	void write(ProcessCommand _pc, const QStringList & _args = QStringList(), const QByteArray & _data = QByteArray())
+	{
+		QByteArray frame = ComputeGridGlobals::makeProcessFrame(_pc, _args, _data);
+
+		if (mTransport)
+		{
+			QByteArray pipeOut;
+			mTransport->send(frame, pipeOut);
+			if (!pipeOut.isEmpty())
+				mProcess.write(pipeOut);
+		}
+		else
+			mProcess.write(frame);
+	}
+
+	// Blocks until a message with _pc arrives.
+	bool waitFor(ProcessCommand _pc, ProcessMessage & _message)
+	{
+		while (true)
+		{
+			for (int i = 0; i < mInbox.count(); ++i)
+			{
+				if (mInbox[i].command == _pc)
+				{
+					_message = mInbox.takeAt(i);
+					return true;
+				}
+			}
+
+			if (!poll())
+				return false;
+		}
+	}
+
+private:
+	bool poll()
+	{
+		if (!mProcess.waitForReadyRead(10000))
+			return false;
+
+		mBuffer.append(mProcess.readAllStandardOutput());
+
+		if (mTransport)
+		{
+			QList<ProcessMessage> pipeMessages;
+			QByteArray pipeOut;
+			ComputeGridGlobals::parseProcessMessages(mBuffer, pipeMessages);
+			mTransport->receive(pipeMessages, mInbox, pipeOut);
+
+			if (!pipeOut.isEmpty())
+				mProcess.write(pipeOut);
+		}
+		else
+			ComputeGridGlobals::parseProcessMessages(mBuffer, mInbox);
+
+		return true;
+	}
+
+	QProcess mProcess;
+	ProcessTransport * mTransport;
+	QByteArray mBuffer;
+	QList<ProcessMessage> mInbox;
+};
+
+static void benchTransport(bool _sharedMemory, int _messages, int _payloadBytes)
+{
+	BenchLink link(_sharedMemory);
+	if (!link.isValid())
+	{
+		out << link.name() << ": child couldn't be started" << endl;
+		return;
+	}
+
+	QByteArray payload(_payloadBytes, 'x');
+	ProcessMessage reply;
+	QElapsedTimer timer;
+
+	// one way: the child only counts, the final status message waits for everything before it
+	timer.start();
+	for (int i = 0; i < _messages; ++i)
+		link.write(PC_WORKER_DATA, QStringList() << QString::number(i), payload);
+
+	link.write(PC_STATUS_MESSAGE);
+	if (!link.waitFor(PC_STATUS_MESSAGE, reply) || reply.args.value(0).toInt() != _messages)
+	{
+		out << link.name() << ": child lost messages" << endl;
+		return;
+	}
+
+	double seconds = timer.nsecsElapsed() / 1e9;
+
+	// ping-pong: one message in flight
+	int rounds = qMin(_messages, 10000);
+	QVector<qint64> rtt;
+	rtt.reserve(rounds);
+
+	for (int i = 0; i < rounds; ++i)
+	{
+		timer.restart();
+		link.write(PC_TASK, QStringList() << QString::number(i), payload);
+		if (!link.waitFor(PC_TASK_RESULT, reply))
+		{
+			out << link.name() << ": child stopped answering" << endl;
+			return;
+		}
+
+		rtt.append(timer.nsecsElapsed());
+	}
+
+	std::sort(rtt.begin(), rtt.end());
+	qint64 sum = 0;
+	for (QVector<qint64>::const_iterator it = rtt.constBegin(); it != rtt.constEnd(); ++it)
+		sum += *it;
+
+	out << QString("%1  %2 msgs x %3 B  %4 msgs/s  %5 MB/s  rtt mean %6 us  p50 %7 us  p99 %8 us")
+		.arg(link.name(), -4)
+		.arg(_messages)
+		.arg(_payloadBytes)
+		.arg(_messages / seconds, 0, 'f', 0)
+		.arg((double)_messages * _payloadBytes / seconds / (1024 * 1024), 0, 'f', 1)
+		.arg(sum / rtt.count() / 1000.0, 0, 'f', 1)
+		.arg(rtt[rtt.count() / 2] / 1000.0, 0, 'f', 1)
+		.arg(rtt[qMin(rtt.count() - 1, rtt.count() * 99 / 100)] / 1000.0, 0, 'f', 1)
+		<< endl;
+}
+
+static void benchNetwork(NetworkBench & _bench, int _messages, int _payloadBytes, int _batchBytes)
+{
+	QString name = _batchBytes > 0 ? QString("batch %1 KB").arg(_batchBytes / 1024) : QString("unbatched");
+
+	if (!_bench.run(_messages, _payloadBytes, _batchBytes))
+	{
+		out << name << ": connection failed or stalled" << endl;
+		return;
+	}
+
+	double seconds = qMax(_bench.seconds(), 1e-9);
+
+	out << QString("%1  %2 msgs x %3 B in %4 packets  %5 msgs/s  %6 MB/s")
+		.arg(name, -12)
+		.arg(_messages)
+		.arg(_payloadBytes)
+		.arg(_bench.packets())
+		.arg(_messages / seconds, 0, 'f', 0)
+		.arg((double)_messages * _payloadBytes / seconds / (1024 * 1024), 0, 'f', 1)
+		<< endl;
+}
+
+int main(int argc, char *argv[])
+{
+	QCoreApplication a(argc, argv);
+	QStringList args = a.arguments();
+
+	if (args.value(1) == "-child")
+		return runChild(args.value(2) == "-shm" ? args.value(3) : QString());
+
+	if (args.value(1) == "transport")
+	{
+		int messages = qMax(1, args.value(2, "100000").toInt());
+		int payloadBytes = qMax(0, args.value(3, "256").toInt());
+
+		benchTransport(false, messages, payloadBytes);
+		benchTransport(true, messages, payloadBytes);
+		return 0;
+	}
+
+	if (args.value(1) == "network")
+	{
+		int messages = qMax(1, args.value(2, "100000").toInt());
+		int payloadBytes = qMax(0, args.value(3, "256").toInt());
+		NetworkBench bench((quint16)args.value(4, "27999").toUInt());
+
+		benchNetwork(bench, messages, payloadBytes, 0);
+		benchNetwork(bench, messages, payloadBytes, 16 * 1024);
+		benchNetwork(bench, messages, payloadBytes, 64 * 1024);
+		return 0;
+	}
+
+	out << "usage: computegridbench transport|network [messages] [payloadBytes] [port]" << endl;
+	return 1;
+}
\ No newline at end of file
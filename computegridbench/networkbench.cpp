@@ -0,0 +1,152 @@
+#include "networkbench.h"
+#include <QTimer>
+
+using namespace ComputeGrid;
+
+NetworkBench::NetworkBench(quint16 _port, QObject * _parent)
+	: QObject(_parent),
+	mPort(_port),
+	mServer(nullptr),
+	mClient(nullptr),
+	mElapsedNs(0),
+	mExpected(0),
+	mReceived(0),
+	mPackets(0)
+{
+}
+
+NetworkBench::~NetworkBench()
+{
+	if (mClient)
+	{
+		if (mClient->state() != QAbstractSocket::UnconnectedState)
+			mClient->disconnectFromServer();
+
+		delete mClient;
+	}
+
+	if (mServer)
+	{
+		if (mServer->isListening())
+			mServer->stopServer();
+
+		delete mServer;
+	}
+}
+
+// Blocks until the server counted every message; false if the connection failed or stalled for 60 s.
+bool NetworkBench::run(int _messages, int _payloadBytes, int _batchBytes)
+{
+	if (!mServer)
+	{
+		mServer = new NetworkServer(mPort);
+		QObject::connect(mServer, SIGNAL(packetReceived(NetworkClientInfo, NetworkPacket)), this, SLOT(packetReceived(NetworkClientInfo, NetworkPacket)));
+		if (!mServer->startServer())
+			return false;
+
+		mClient = new NetworkClient("127.0.0.1", mPort);
+		if (!mClient->connectToServer(5000))
+			return false;
+	}
+
+	QByteArray payload(_payloadBytes, 'x');
+
+	mExpected = _messages;
+	mReceived = 0;
+	mPackets = 0;
+	mElapsedNs = 0;
+	mTimer.start();
+
+	QByteArray batch;
+	int count = 0;
+
+	for (int i = 0; i < _messages; ++i)
+	{
+		if (_batchBytes <= 0)
+		{
+			NetworkPacket np(NPT_DATA);
+			np.setTypeId(DPT_WORKER_RAW_DATA);
+			np.setData(payload);
+			mClient->sendPacket(np);
+			++mPackets;
+			continue;
+		}
+
+		ComputeGridGlobals::appendBatchEntry(batch, DPT_WORKER_RAW_DATA, payload);
+		++count;
+
+		if (batch.size() >= _batchBytes)
+			sendBatch(batch, count, payload);
+	}
+
+	sendBatch(batch, count, payload);
+
+	QTimer stallTimer;
+	stallTimer.setSingleShot(true);
+	QObject::connect(&stallTimer, SIGNAL(timeout()), this, SLOT(timeout()));
+	stallTimer.start(60000);
+
+	if (mReceived < mExpected)
+		mLoop.exec();
+
+	return mReceived >= mExpected;
+}
+
+double NetworkBench::seconds() const
+{
+	return mElapsedNs / 1e9;
+}
+
+int NetworkBench::packets() const
+{
+	return mPackets;
+}
+
+void NetworkBench::sendBatch(QByteArray & _batch, int & _count, const QByteArray & _payload)
+{
+	if (_count == 0)
+		return;
+
+	NetworkPacket np(NPT_DATA);
+	if (_count == 1)
+	{
+		np.setTypeId(DPT_WORKER_RAW_DATA);
+		np.setData(_payload);
+	}
+	else
+	{
+		np.setTypeId(DPT_WORKER_DATA_BATCH);
+		np.setData(_batch);
+	}
+
+	mClient->sendPacket(np);
+	++mPackets;
+
+	_batch.clear();
+	_count = 0;
+}
+
+#pragma region Slots
+void NetworkBench::packetReceived(NetworkClientInfo _clientInfo, NetworkPacket _packet)
+{
+	if (_packet.typeId() == DPT_WORKER_DATA_BATCH)
+	{
+		QList<QPair<DataPacketType, QByteArray>> entries;
+		ComputeGridGlobals::parseBatch(*_packet.dataPtr(), entries);
+		mReceived += entries.count();
+	}
+	else
+		++mReceived;
+
+	if (mReceived >= mExpected)
+	{
+		mElapsedNs = mTimer.nsecsElapsed();
+		mLoop.quit();
+	}
+}
+
+void NetworkBench::timeout()
+{
+	mLoop.quit();
+}
+#pragma endregion
\ No newline at end of file
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <QObject>
+#include <QEventLoop>
+#include <QElapsedTimer>
+#include "computegridcommons.hpp"
+#include "networkserver.h"
+#include "networkclient.h"
+
+using namespace Networking;
+
+// One loopback connection through the Networking library: a client pumps DPT_WORKER_RAW_DATA packets to a
+// server in the same process, either one packet per message or packed into DPT_WORKER_DATA_BATCH packets
+// the way the hosts batch them.
+class NetworkBench : public QObject
+{
+	Q_OBJECT
+
+public:
+	NetworkBench(quint16 _port, QObject * _parent = nullptr);
+	~NetworkBench();
+
+	bool run(int _messages, int _payloadBytes, int _batchBytes);
+	double seconds() const;
+	int packets() const;
+
+private:
+	void sendBatch(QByteArray & _batch, int & _count, const QByteArray & _payload);
+
+	quint16 mPort;
+	NetworkServer * mServer;
+	NetworkClient * mClient;
+	QEventLoop mLoop;
+	QElapsedTimer mTimer;
+	qint64 mElapsedNs;
+	int mExpected;
+	int mReceived;
+	int mPackets;
+
+private slots:
+	void packetReceived(NetworkClientInfo _clientInfo, NetworkPacket _packet);
+	void timeout();
+};
\ No newline at end of file
@@ -0,0 +1,158 @@
+#pragma once
+
+#include <algorithm>
+#include <QBuffer>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QSet>
+#include <QStringList>
+#include <QThread>
+#include <QtConcurrent>
+#include "quazip.h"
+#include "quazipfile.h"
+
+namespace ComputeGrid
+{
+	// Drop-in for JlCompress::extractDir that reads the archive from a file or straight from memory and
+	// inflates the entries on all cores. QuaZip instances can't be shared between threads, so the entries
+	// are split into one batch per thread, balanced by size, and every batch opens the archive on its own.
+	class ArchiveExtractor
+	{
+	public:
+		// Returns the extracted files, empty if any entry failed.
+		static QStringList extract(const QString & _archiveFile, const QString & _dir)
+		{
+			return extract(_archiveFile, QByteArray(), _dir);
+		}
+
+		static QStringList extract(const QByteArray & _archiveData, const QString & _dir)
+		{
+			return extract(QString(), _archiveData, _dir);
+		}
+
+	private:
+		struct Batch
+		{
+			QSet<QString> names;
+			qint64 bytes;
+			bool ok;
+		};
+
+		static QStringList extract(const QString & _archiveFile, const QByteArray & _archiveData, const QString & _dir)
+		{
+			QDir dir(_dir);
+			QList<QuaZipFileInfo64> entries;
+			{
+				QBuffer buffer;
+				QuaZip zip;
+				if (!open(zip, buffer, _archiveFile, _archiveData))
+					return QStringList();
+
+				entries = zip.getFileInfoList64();
+				zip.close();
+			}
+
+			std::sort(entries.begin(), entries.end(), [](const QuaZipFileInfo64 & _a, const QuaZipFileInfo64 & _b) { return _a.uncompressedSize > _b.uncompressedSize; });
+
+			QList<Batch> batches;
+			for (int i = qMax(1, qMin(QThread::idealThreadCount(), entries.count())); i > 0; --i)
+			{
+				Batch b;
+				b.bytes = 0;
+				b.ok = false;
+				batches.append(b);
+			}
+
+			QStringList files;
+			for (QList<QuaZipFileInfo64>::const_iterator it = entries.constBegin(); it != entries.constEnd(); ++it)
+			{
+				QString path = QDir::cleanPath(dir.absoluteFilePath((*it).name));
+				if (!path.startsWith(dir.absolutePath() + "/"))
+					return QStringList(); // entry would land outside _dir
+
+				// directories are made up front, the threads would race on them
+				if ((*it).name.endsWith('/'))
+				{
+					dir.mkpath(path);
+					continue;
+				}
+
+				dir.mkpath(QFileInfo(path).absolutePath());
+				files.append(path);
+
+				// largest entries first, each to the lightest batch
+				Batch * lightest = &batches.first();
+				for (QList<Batch>::iterator b = batches.begin(); b != batches.end(); ++b)
+				{
+					if ((*b).bytes < lightest->bytes)
+						lightest = &(*b);
+				}
+
+				lightest->names.insert((*it).name);
+				lightest->bytes += (*it).uncompressedSize;
+			}
+
+			QtConcurrent::blockingMap(batches, [&](Batch & _batch) { _batch.ok = extractBatch(_archiveFile, _archiveData, dir, _batch.names); });
+
+			for (QList<Batch>::const_iterator b = batches.constBegin(); b != batches.constEnd(); ++b)
+			{
+				if (!(*b).ok)
+					return QStringList();
+			}
+
+			return files;
+		}
+
+		static bool extractBatch(const QString & _archiveFile, const QByteArray & _archiveData, const QDir & _dir, const QSet<QString> & _names)
+		{
+			if (_names.isEmpty())
+				return true;
+
+			QBuffer buffer;
+			QuaZip zip;
+			if (!open(zip, buffer, _archiveFile, _archiveData))
+				return false;
+
+			bool res = true;
+			for (bool more = zip.goToFirstFile(); more && res; more = zip.goToNextFile())
+			{
+				QString name = zip.getCurrentFileName();
+				if (!_names.contains(name))
+					continue;
+
+				QuaZipFile in(&zip);
+				QFile out(_dir.absoluteFilePath(name));
+				res = in.open(QIODevice::ReadOnly) && out.open(QIODevice::WriteOnly);
+
+				while (res && !in.atEnd())
+				{
+					QByteArray block = in.read(BlockSize);
+					res = !block.isEmpty() && out.write(block) == block.size();
+				}
+
+				in.close();
+				res = res && in.getZipError() == UNZ_OK; // crc is checked on close
+				out.close();
+			}
+
+			zip.close();
+			return res;
+		}
+
+		static bool open(QuaZip & _zip, QBuffer & _buffer, const QString & _archiveFile, const QByteArray & _archiveData)
+		{
+			if (_archiveFile.isEmpty())
+			{
+				_buffer.setData(_archiveData); // shared, not copied
+				_zip.setIoDevice(&_buffer);
+			}
+			else
+				_zip.setZipName(_archiveFile);
+
+			return _zip.open(QuaZip::mdUnzip);
+		}
+
+		static const int BlockSize = 1024 * 1024;
+	};
+}
\ No newline at end of file
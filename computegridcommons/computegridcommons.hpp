@@ -2,6 +2,10 @@
 
 #include <QString>
 #include <QStringList>
+#include <QByteArray>
+#include <QList>
+#include <QPair>
+#include <QtEndian>
 
 namespace ComputeGrid
 {
@@ -23,23 +27,77 @@ namespace ComputeGrid
 
 	enum DataPacketType
 	{
-		DPT_HEARTHBEAT	= 1,
+		DPT_HEARTHBEAT	= 1,	// [GM <> GW] rawData=manager clock in ms (GW echoes it back for RTT) || empty (GW is idle but alive)
 		DPT_GRID_ATTACH,		// [GM > GW] rawData=workerProcessData
-		DPT_GRID_WORKER_READY,	// [GW > GM] no args
+		DPT_GRID_WORKER_READY,	// [GW > GM] p1=task slots of the worker, p2=supported compression codecs (comma seperated), p3=prefetch depth, p4=peer port serving the offered archive (0 if it doesn't), p6=accepts DPT_WORKER_DATA_BATCH (1/0), p7=credit window in bytes (0 leaves the manager unlimited); p6 and p7 are positional, p5 is sent empty
 		DPT_WORKER_DATA,		// [GM <> GW] p1=worker, p2..pN=work spesific args
 		DPT_WORKER_EXIT,		// [GW <> GM] p1=worker, (GM> p2..pN=work spesific args) || (GW> p2=exitCode, p3=exitStatus)
-		DPT_LOG					// [GW > GM] p1=LogSource, p2=LogType, p3=logMessage
+		DPT_LOG,				// [GW > GM] p1=LogSource, p2=LogType, p3=logMessage
+		DPT_WORKER_RAW_DATA,	// [GM <> GW] rawData=work spesific bytes
+		DPT_WORKER_DATA_BATCH,	// [GM <> GW] rawData={[typeId:1][length:4][packetData]}*
+		DPT_GRID_CONFIG,		// [GM > GW] p1=compression codec, p2=compression threshold in bytes, p3=work stealing (1/0), p4=heartbeat interval in ms, p5=accepts DPT_WORKER_DATA_BATCH (1/0)
+		DPT_COMPRESSED,			// [GM <> GW] rawData=[codec:1][typeId:1][compressed packetData]
+		DPT_TASK,				// [GM > GW] p1=taskId, p2..pN=work spesific args
+		DPT_TASK_RESULT,		// [GW > GM] p1=taskId, p2..pN=work spesific results
+		DPT_STEAL_REQUEST,		// [GW > GM] p1=free slots (local task queue is empty)
+		DPT_STEAL_REVOKE,		// [GM <> GW] (GM> p1=count, give back up to count not started tasks) || (GW> p1..pN=revoked taskIds)
+		DPT_STEAL_GRANT,		// [GM > GW] p1=stolen task count (sent right after the stolen tasks as DPT_TASK, 0 if nothing to steal)
+		DPT_CREDIT,				// [GW > GM] p1=bytes the manager may send on top of its remaining credit (the initial window comes with DPT_GRID_WORKER_READY)
+		DPT_GRID_ATTACH_OFFER,	// [GM > GW] p1=sha256 of workerProcessData (hex), p2=size in bytes
+		DPT_GRID_ATTACH_REQUEST,// [GW > GM] p1=sha256 of the offered archive (not in the worker's cache), p2=offset to resume from
+		DPT_GRID_ATTACH_CHUNK,	// [GM > GW] p1=sha256, p2=offset, p3=md5 of the chunk (hex), followed by the chunk bytes
+		DPT_GRID_ATTACH_ACK,	// [GW > GM] p1=sha256, p2=bytes written so far, p3=1 (chunk at p2 was corrupt, resend from there) || p3=0
+		DPT_GRID_ATTACH_MANIFEST,// [GW > GM] p1=sha256 of the offered archive, p2..pN=manifest entries of the installed worker files
+		DPT_GRID_ATTACH_DELTA,	// [GM > GW] p1=sha256 of the offered archive, p2=sha256 of the delta archive (== p1 when the whole archive is sent, empty when nothing is added), p3=delta size, p4..pN=files to remove
+		DPT_GRID_ATTACH_PEER,	// [GM > GW] p1=sha256, p2=seeder address, p3=seeder peer port, p4=size (fetch the archive from that worker) || [GW > GW] empty (seeder doesn't hold the archive)
+		DPT_TASK_FAILED,		// [GW > GM] p1..pN=taskIds lost with a crashed worker process (the manager requeues them)
+		DPT_WORKER_SLOTS,		// [GW > GM] p1=task slots of the worker (a worker process was lost and not restarted)
+		DPT_TASK_CANCEL			// [GM > GW] p1=taskId (a speculative copy lost, or the task was reassigned while the worker was suspected)
 	};
 
+	enum CompressionCodec
+	{
+		CC_NONE,
+		CC_ZLIB_FAST,	// qCompress level 1
+		CC_ZLIB			// qCompress default level
+	};
+
+	// "worker" in manager process commands is the numeric handle the Grid-Manager assigns when a worker attaches
 	enum ProcessCommand
 	{
-		PC_GRID_WORKER_IN,		// [GM > MP || GW > WP] (GM> p1=worker p2=ideal_thread_count_of_worker) || (GW> no args)
+		PC_GRID_WORKER_IN,		// [GM > MP || GW > WP] (GM> p1=worker p2=ideal_thread_count_of_worker p3=worker_address) || (GW> no args)
 		PC_GRID_WORKER_OUT,		// [GM > MP || GW > WP] (GM> p1=worker) || (GW> no args)
 		PC_WORKER_DATA,			// [WP <> MP] p1=worker, p2..pN=work spesific args
 		PC_WORKER_EXIT,			// [MP > WP || GW > MP] p1=worker, (MP> p2..pN=work spesific args) || (GW> p2=exitCode, p3=exitStatus)
 		PC_LOG,					// [WP > GM || MP > GM] p1=LogSource, p2=LogType, p3=logMessage
 		PC_STATUS_MESSAGE,		// [MP > GM || WP > GW] p1=Message
-		PC_TERMINAL_COMMAND		// [GM > MP] p1..pN=work spesific args
+		PC_TERMINAL_COMMAND,	// [GM > MP] p1..pN=work spesific args
+		PC_TRANSPORT,			// [GM/GW <> MP/WP] p1=shm (writing to the shared-memory ring from now on) || p1=wake (ring has unread records) || p1=space (ring has room again) || p1=fenced (next pipe message is fenced in the ring)
+		PC_WORKER_ADDRESS,		// [MP <> GM] p1=worker, (GM> p2=worker_address, empty if unknown)
+		PC_WORKER_RAW_DATA,		// [WP <> MP] (MP> p1=worker) || (WP> no args), rawData=work spesific bytes (binary framing only)
+		PC_TASK_SUBMIT,			// [MP > GM] p1=taskId, p2..pN=work spesific args (scheduled onto any worker with a free slot)
+		PC_TASK,				// [GW > WP] p1=taskId, p2..pN=work spesific args
+		PC_TASK_RESULT,			// [WP > GW || GM > MP] (WP> p1=taskId, p2..pN=work spesific results) || (GM> p1=taskId, p2=worker, p3..pN=work spesific results)
+		PC_TASK_FAILED,			// [GM > MP] p1=taskId, p2=attempts (every worker it was given to dropped out, 0 if the id was already queued or running)
+		PC_FLOW_CONTROL,		// [GM > MP] p1=worker (0 for the whole grid), p2=1 (out of credit, hold back) || p2=0 (resume)
+		PC_SESSION_RESET,		// [GW <> WP] (GW> no args, drop every state of the session, the process waits for the next one) || (WP> no args, state dropped; processes that don't answer are never reused)
+		PC_TASK_CANCEL			// [GW <> WP] p1=taskId, (GW> stop running it) || (WP> stopped, its slot is free; until then it counts as running)
+	};
+
+	enum ProcessFraming
+	{
+		PF_TEXT,	// $cmd|p1|..|pN\n (legacy manager.exe/worker.exe builds)
+		PF_BINARY	// [prefix:1][command:1][length:4] + [argCount:2]{[argLength:4][utf8]}*[rawData]
+	};
+#pragma endregion
+
+#pragma region Structs
+	struct ProcessMessage
+	{
+		ProcessCommand command;
+		QStringList args;
+		QByteArray data;
+		ProcessFraming framing;
 	};
 #pragma endregion
 
@@ -62,8 +120,23 @@ namespace ComputeGrid
 		<< "wex"
 		<< "log"
 		<< "stm"
-		<< "tc";
+		<< "tc"
+		<< "tr"
+		<< "wad"
+		<< "wrd"
+		<< "tsub"
+		<< "tsk"
+		<< "tres"
+		<< "tfail"
+		<< "fc"
+		<< "srst"
+		<< "tcan";
+
 
+	static QStringList LiteralCompressionCodec = QStringList()
+		<< "none"
+		<< "zfast"
+		<< "zlib";
 
 	static QStringList LiteralSocketError = QStringList()
 		<< "ConnectionRefusedError"
@@ -145,6 +218,190 @@ namespace ComputeGrid
 
 			return res;
 		}
+
+		static QByteArray makeProcessFrame(ProcessCommand _pc, const QStringList & _args = QStringList(), const QByteArray & _data = QByteArray())
+		{
+			QByteArray frame;
+			frame.reserve(ProcessFrameHeaderSize + 2 + _args.count() * 16 + _data.size());
+			frame.append(ProcessFramePrefix);
+			frame.append((char)_pc);
+			appendUInt32(frame, 0); // patched below
+			appendUInt16(frame, (quint16)_args.count());
+
+			for (QStringList::const_iterator it = _args.constBegin(); it != _args.constEnd(); ++it)
+			{
+				QByteArray arg = (*it).toUtf8();
+				appendUInt32(frame, (quint32)arg.size());
+				frame.append(arg);
+			}
+
+			frame.append(_data);
+
+			qToBigEndian<quint32>((quint32)(frame.size() - ProcessFrameHeaderSize), reinterpret_cast<uchar *>(frame.data() + 2));
+			return frame;
+		}
+
+		static QByteArray makeProcessMessage(ProcessFraming _framing, ProcessCommand _pc, const QStringList & _args = QStringList())
+		{
+			if (_framing == PF_BINARY)
+				return makeProcessFrame(_pc, _args);
+
+			return (makeProcessCommand(_pc, _args).simplified() + ProcessCommandSuffix).toLocal8Bit();
+		}
+
+		// Extracts every complete message at the head of _buffer (text lines and binary frames may be mixed)
+		// and removes the consumed bytes. Returns the number of messages appended to _messages.
+		static int parseProcessMessages(QByteArray & _buffer, QList<ProcessMessage> & _messages)
+		{
+			int count = 0;
+			int pos = 0;
+
+			while (pos < _buffer.size())
+			{
+				ProcessMessage msg;
+
+				if (_buffer.at(pos) == ProcessFramePrefix)
+				{
+					if (_buffer.size() - pos < ProcessFrameHeaderSize)
+						break;
+
+					const char * header = _buffer.constData() + pos;
+					quint32 length = qFromBigEndian<quint32>(reinterpret_cast<const uchar *>(header + 2));
+					if (length > ProcessFrameMaxLength)
+					{
+						++pos; // corrupt header, resync on next byte
+						continue;
+					}
+
+					if ((quint32)(_buffer.size() - pos - ProcessFrameHeaderSize) < length)
+						break;
+
+					if (parseProcessFrame((quint8)header[1], header + ProcessFrameHeaderSize, length, msg))
+					{
+						_messages.append(msg);
+						++count;
+					}
+
+					pos += ProcessFrameHeaderSize + length;
+				}
+				else
+				{
+					int eol = _buffer.indexOf(ProcessCommandSuffix.toLatin1(), pos);
+					if (eol < 0)
+						break;
+
+					QString line = QString::fromLocal8Bit(_buffer.constData() + pos, eol - pos);
+					if (line.endsWith('\r'))
+						line.chop(1);
+
+					if (parseProcessCommand(line, msg.command, msg.args))
+					{
+						msg.framing = PF_TEXT;
+						_messages.append(msg);
+						++count;
+					}
+
+					pos = eol + 1;
+				}
+			}
+
+			if (pos > 0)
+				_buffer.remove(0, pos);
+
+			return count;
+		}
+
+		static void appendBatchEntry(QByteArray & _batch, DataPacketType _type, const QByteArray & _data)
+		{
+			_batch.append((char)_type);
+			appendUInt32(_batch, (quint32)_data.size());
+			_batch.append(_data);
+		}
+
+		static bool compressPacketData(CompressionCodec _codec, DataPacketType _type, const QByteArray & _data, QByteArray & _out)
+		{
+			if (_codec == CC_NONE)
+				return false;
+
+			QByteArray packed = qCompress(_data, _codec == CC_ZLIB_FAST ? 1 : -1);
+			if (packed.size() + 2 >= _data.size())
+				return false; // not worth it
+
+			_out.clear();
+			_out.reserve(packed.size() + 2);
+			_out.append((char)_codec);
+			_out.append((char)_type);
+			_out.append(packed);
+			return true;
+		}
+
+		static bool decompressPacketData(const QByteArray & _data, DataPacketType & _type, QByteArray & _out)
+		{
+			if (_data.size() < 2 || (quint8)_data.at(0) == CC_NONE || (quint8)_data.at(0) >= LiteralCompressionCodec.count())
+				return false;
+
+			_type = (DataPacketType)(quint8)_data.at(1);
+			_out = qUncompress(reinterpret_cast<const uchar *>(_data.constData() + 2), _data.size() - 2);
+			return !_out.isEmpty();
+		}
+
+		// Packets the Grid-Manager sends through a worker's credit window; the worker grants back only their bytes.
+		// Heartbeats and the archive transfer go out regardless of credit and are counted on neither side.
+		static bool isCreditedPacket(DataPacketType _type, const QByteArray & _data)
+		{
+			if (_type == DPT_COMPRESSED)
+				return _data.size() >= 2 && isCreditedPacket((DataPacketType)(quint8)_data.at(1), QByteArray());
+
+			return _type == DPT_WORKER_DATA || _type == DPT_WORKER_EXIT || _type == DPT_WORKER_RAW_DATA || _type == DPT_WORKER_DATA_BATCH
+				|| _type == DPT_GRID_CONFIG || _type == DPT_TASK || _type == DPT_STEAL_REVOKE || _type == DPT_STEAL_GRANT || _type == DPT_TASK_CANCEL;
+		}
+
+		// Archive manifest entry: "crc32:size:path", path relative to the worker directory.
+		static QString makeManifestEntry(const QString & _path, quint32 _crc, qint64 _size)
+		{
+			return QString("%1:%2:%3").arg(_crc, 8, 16, QChar('0')).arg(_size).arg(_path);
+		}
+
+		static QString manifestEntryPath(const QString & _entry)
+		{
+			return _entry.section(':', 2);
+		}
+
+		// Archives are named by their sha256 in lower case hex; anything else from the network never names a file.
+		static bool isArchiveHash(const QString & _hash)
+		{
+			if (_hash.size() != 64)
+				return false;
+
+			for (QString::const_iterator it = _hash.constBegin(); it != _hash.constEnd(); ++it)
+			{
+				if (!((*it >= '0' && *it <= '9') || (*it >= 'a' && *it <= 'f')))
+					return false;
+			}
+
+			return true;
+		}
+
+		static bool parseBatch(const QByteArray & _batch, QList<QPair<DataPacketType, QByteArray>> & _entries)
+		{
+			const char * p = _batch.constData();
+			const char * end = p + _batch.size();
+
+			while (end - p >= 5)
+			{
+				DataPacketType type = (DataPacketType)(quint8)p[0];
+				quint32 length = qFromBigEndian<quint32>(reinterpret_cast<const uchar *>(p + 1));
+				p += 5;
+
+				if ((quint32)(end - p) < length)
+					return false;
+
+				_entries.append(qMakePair(type, QByteArray(p, length)));
+				p += length;
+			}
+
+			return p == end;
+		}
 #pragma endregion
 
 #pragma region Fields
@@ -152,9 +409,61 @@ namespace ComputeGrid
 		static constexpr QChar ProcessCommandSuffix = '\n';
 		static constexpr QChar ProcessCommandSeperator = '|';
 		static constexpr QChar ProcessCommandDataSeperator = '#';
+		static constexpr char ProcessFramePrefix = '\x02';
+		static constexpr int ProcessFrameHeaderSize = 6;
+		static constexpr quint32 ProcessFrameMaxLength = 256 * 1024 * 1024;
+		static constexpr const char * ProcessArgBinaryFraming = "-binary";
+		static constexpr const char * ProcessArgSharedMemory = "-shm";
+		static constexpr int ArchiveChunkSize = 256 * 1024;
+		static constexpr int ArchiveWindowChunks = 8; // unacknowledged chunks on the way
 #pragma endregion
 
 	private:
 		ComputeGridGlobals() { /* private ctor! */ }
+
+		static void appendUInt16(QByteArray & _buffer, quint16 _value)
+		{
+			_value = qToBigEndian(_value);
+			_buffer.append(reinterpret_cast<const char *>(&_value), sizeof(_value));
+		}
+
+		static void appendUInt32(QByteArray & _buffer, quint32 _value)
+		{
+			_value = qToBigEndian(_value);
+			_buffer.append(reinterpret_cast<const char *>(&_value), sizeof(_value));
+		}
+
+		static bool parseProcessFrame(quint8 _command, const char * _payload, quint32 _length, ProcessMessage & _msg)
+		{
+			if (_command >= (quint8)LiteralProcessCommand.count() || _length < 2)
+				return false;
+
+			const uchar * p = reinterpret_cast<const uchar *>(_payload);
+			const uchar * end = p + _length;
+			quint16 argCount = qFromBigEndian<quint16>(p);
+			p += 2;
+
+			for (quint16 i = 0; i < argCount; ++i)
+			{
+				if (end - p < 4)
+					return false;
+
+				quint32 argLength = qFromBigEndian<quint32>(p);
+				p += 4;
+
+				if ((quint32)(end - p) < argLength)
+					return false;
+
+				_msg.args.append(QString::fromUtf8(reinterpret_cast<const char *>(p), argLength));
+				p += argLength;
+			}
+
+			if (p < end)
+				_msg.data = QByteArray(reinterpret_cast<const char *>(p), (int)(end - p));
+
+			_msg.command = (ProcessCommand)_command;
+			_msg.framing = PF_BINARY;
+			return true;
+		}
 	};
 }
\ No newline at end of file
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <cmath>
+#include <QQueue>
+#include <QtGlobal>
+
+namespace ComputeGrid
+{
+	// Phi-accrual failure detector (Hayashibara et al.): instead of a fixed timeout it keeps the
+	// distribution of heartbeat inter-arrival times and tells how unlikely the current silence is.
+	// phi = 1 means ~10% chance the peer is still alive, 2 means ~1%, 8 means ~0.000001%.
+	class PhiAccrualDetector
+	{
+	public:
+		PhiAccrualDetector(qint64 _expectedIntervalMs = 1000)
+			: mLastMs(-1),
+			mLastHeartbeatMs(-1),
+			mSum(0),
+			mSquaredSum(0)
+		{
+			reset(_expectedIntervalMs);
+		}
+
+		// Starts over with a guess of the interval until real samples come in.
+		void reset(qint64 _expectedIntervalMs)
+		{
+			mExpectedIntervalMs = qMax<qint64>(1, _expectedIntervalMs);
+			mIntervals.clear();
+			mSum = 0;
+			mSquaredSum = 0;
+			mLastMs = -1;
+			mLastHeartbeatMs = -1;
+
+			add(mExpectedIntervalMs - mExpectedIntervalMs / 4);
+			add(mExpectedIntervalMs + mExpectedIntervalMs / 4);
+		}
+
+		// Heartbeats and probe echoes only; their spacing is what the intervals are learnt from.
+		void heartbeat(qint64 _nowMs)
+		{
+			if (mLastHeartbeatMs >= 0)
+				add(_nowMs - mLastHeartbeatMs);
+
+			mLastHeartbeatMs = _nowMs;
+			mLastMs = _nowMs;
+		}
+
+		// Any other packet from the peer: it's alive, but bursts of data would skew the intervals.
+		void seen(qint64 _nowMs)
+		{
+			mLastMs = qMax(mLastMs, _nowMs);
+		}
+
+		qint64 lastHeartbeatMs() const
+		{
+			return mLastMs;
+		}
+
+		double phi(qint64 _nowMs) const
+		{
+			if (mLastMs < 0)
+				return 0;
+
+			double mean = mSum / mIntervals.count();
+			double deviation = qMax(std::sqrt(qMax(0.0, mSquaredSum / mIntervals.count() - mean * mean)), mean * MinDeviationRatio);
+
+			// logistic approximation of the normal CDF
+			double y = ((_nowMs - mLastMs) - mean) / deviation;
+			double e = std::exp(-y * (1.5976 + 0.070566 * y * y));
+			double pLater = (_nowMs - mLastMs) > mean ? e / (1.0 + e) : 1.0 - 1.0 / (1.0 + e);
+
+			return -std::log10(qMax(pLater, 1e-300));
+		}
+
+		bool isSuspected(qint64 _nowMs, double _threshold) const
+		{
+			return phi(_nowMs) > _threshold;
+		}
+
+#pragma region Fields
+		static const int WindowSize = 100;
+		static constexpr double MinDeviationRatio = 0.1;
+#pragma endregion
+
+	private:
+		void add(qint64 _intervalMs)
+		{
+			mIntervals.enqueue(_intervalMs);
+			mSum += _intervalMs;
+			mSquaredSum += (double)_intervalMs * _intervalMs;
+
+			if (mIntervals.count() > WindowSize)
+			{
+				qint64 old = mIntervals.dequeue();
+				mSum -= old;
+				mSquaredSum -= (double)old * old;
+			}
+		}
+
+		qint64 mExpectedIntervalMs;
+		qint64 mLastMs; // anything heard
+		qint64 mLastHeartbeatMs;
+		QQueue<qint64> mIntervals;
+		double mSum;
+		double mSquaredSum;
+	};
+}
\ No newline at end of file
@@ -0,0 +1,199 @@
+#pragma once
+
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QDir>
+#include <QDirIterator>
+#include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QString>
+#include <QStringList>
+
+namespace ComputeGrid
+{
+	// Extracted process archives, content-addressed: <root>/trees/<name>-<sha256>/ holds one archive's files,
+	// <root>/<name>.current names the tree in use. Trees are extracted under a staging name and renamed
+	// into place once complete, the pointer file is replaced atomically, <tree>.tested marks a passed
+	// self-test and <tree>.manifest lists its files; so an archive that was installed before is neither
+	// extracted, tested nor scanned again.
+	class ProcessInstallation
+	{
+	public:
+		ProcessInstallation(const QString & _root, const QString & _name)
+			: mRoot(_root),
+			mName(_name)
+		{
+		}
+
+		static QString hashFile(const QString & _file)
+		{
+			QFile f(_file);
+			QCryptographicHash hash(QCryptographicHash::Sha256);
+			if (!f.open(QIODevice::ReadOnly) || !hash.addData(&f))
+				return QString();
+
+			return hash.result().toHex();
+		}
+
+		// Installations made before trees existed live in <root>/<name>.
+		QString currentDir() const
+		{
+			QFile f(pointerFile());
+			if (f.open(QIODevice::ReadOnly))
+			{
+				QString hash = QString::fromUtf8(f.readAll()).trimmed();
+				if (!hash.isEmpty() && QFileInfo(treeDir(hash)).isDir())
+					return treeDir(hash);
+			}
+
+			return mRoot + "/" + mName;
+		}
+
+		QString currentHash() const
+		{
+			QFile f(pointerFile());
+			return f.open(QIODevice::ReadOnly) ? QString::fromUtf8(f.readAll()).trimmed() : QString();
+		}
+
+		QString executable() const
+		{
+			return currentDir() + "/" + mName + ".exe";
+		}
+
+		QString treeDir(const QString & _hash) const
+		{
+			return mRoot + "/trees/" + mName + "-" + _hash;
+		}
+
+		QString stagingDir(const QString & _hash) const
+		{
+			return treeDir(_hash) + ".tmp";
+		}
+
+		// Working directory of the processes, so whatever they write stays out of the content-addressed trees.
+		QString scratchDir() const
+		{
+			return mRoot + "/" + mName + ".scratch";
+		}
+
+		bool hasTree(const QString & _hash) const
+		{
+			return QFile::exists(treeDir(_hash) + "/" + mName + ".exe");
+		}
+
+		bool isTested(const QString & _hash) const
+		{
+			return QFile::exists(treeDir(_hash) + ".tested");
+		}
+
+		void markTested(const QString & _hash)
+		{
+			QFile f(treeDir(_hash) + ".tested");
+			if (f.open(QIODevice::WriteOnly))
+			{
+				f.write(QDateTime::currentDateTime().toString(Qt::ISODate).toUtf8());
+				f.close();
+			}
+		}
+
+		bool hasManifest(const QString & _hash) const
+		{
+			return QFile::exists(treeDir(_hash) + ".manifest");
+		}
+
+		// One manifest entry per line.
+		QStringList manifest(const QString & _hash) const
+		{
+			QFile f(treeDir(_hash) + ".manifest");
+			if (!f.open(QIODevice::ReadOnly))
+				return QStringList();
+
+			return QString::fromUtf8(f.readAll()).split('\n', QString::SkipEmptyParts);
+		}
+
+		void setManifest(const QString & _hash, const QStringList & _manifest)
+		{
+			QSaveFile f(treeDir(_hash) + ".manifest");
+			if (f.open(QIODevice::WriteOnly))
+			{
+				f.write(_manifest.join('\n').toUtf8());
+				f.commit();
+			}
+		}
+
+		// Copies the tree in use to the staging name of _hash for a delta to be extracted over; the tree in use
+		// is left untouched until the new one is committed and made current.
+		bool stageCurrent(const QString & _hash)
+		{
+			QDir src(currentDir());
+			QDir dst(stagingDir(_hash));
+			if (!src.exists() || !dst.mkpath(dst.absolutePath()))
+				return false;
+
+			QDirIterator it(src.absolutePath(), QDir::Files | QDir::Hidden, QDirIterator::Subdirectories);
+			while (it.hasNext())
+			{
+				QString file = it.next();
+				QString target = dst.absoluteFilePath(src.relativeFilePath(file));
+				if (!QDir().mkpath(QFileInfo(target).absolutePath()) || !QFile::copy(file, target))
+					return false;
+			}
+
+			return true;
+		}
+
+		// Renames a completely extracted staging tree into place.
+		bool commitTree(const QString & _hash)
+		{
+			QDir tree(treeDir(_hash));
+			if (tree.exists() && !tree.removeRecursively())
+				return false;
+
+			QFile::remove(treeDir(_hash) + ".tested");
+			QFile::remove(treeDir(_hash) + ".manifest");
+			return QDir().rename(stagingDir(_hash), treeDir(_hash));
+		}
+
+		bool setCurrent(const QString & _hash)
+		{
+			QSaveFile f(pointerFile());
+			if (!f.open(QIODevice::WriteOnly))
+				return false;
+
+			f.write(_hash.toUtf8());
+			return f.commit();
+		}
+
+		// Keeps the tree in use and the most recent others, up to _keep trees.
+		void prune(int _keep)
+		{
+			QString current = QFileInfo(currentDir()).fileName();
+			QDir trees(mRoot + "/trees");
+
+			QFileInfoList dirs = trees.entryInfoList(QStringList() << mName + "-*", QDir::Dirs | QDir::NoDotAndDotDot, QDir::Time);
+			int kept = 0;
+			for (QFileInfoList::iterator it = dirs.begin(); it != dirs.end(); ++it)
+			{
+				if ((*it).fileName() == current)
+					continue;
+
+				if ((*it).fileName().endsWith(".tmp") || ++kept >= _keep)
+				{
+					QDir((*it).absoluteFilePath()).removeRecursively();
+					QFile::remove((*it).absoluteFilePath() + ".tested");
+					QFile::remove((*it).absoluteFilePath() + ".manifest");
+				}
+			}
+		}
+
+	private:
+		QString pointerFile() const
+		{
+			return mRoot + "/" + mName + ".current";
+		}
+
+		QString mRoot;
+		QString mName;
+	};
+}
\ No newline at end of file
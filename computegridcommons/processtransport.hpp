@@ -0,0 +1,371 @@
+#pragma once
+
+#include <atomic>
+#include <cstring>
+#include <new>
+#include <QSharedMemory>
+#include <QByteArray>
+#include <QList>
+#include <QQueue>
+#include "computegridcommons.hpp"
+
+namespace ComputeGrid
+{
+	// Single-producer/single-consumer ring living in a shared memory segment.
+	// Records are [length:4][frame]; a zero length record fences the next message sent over the pipe.
+	// Either side that finds the other idle (reader drained, writer out of space) rings a doorbell on the pipe.
+	class SharedRingBuffer
+	{
+	public:
+		struct Header
+		{
+			std::atomic<quint64> writePos;
+			std::atomic<quint64> readPos;
+			std::atomic<quint32> readerWaiting;
+			std::atomic<quint32> writerWaiting;
+			quint32 capacity;
+		};
+
+		SharedRingBuffer()
+			: mHeader(nullptr),
+			mData(nullptr)
+		{
+		}
+
+		static int segmentSize(quint32 _capacity)
+		{
+			return (int)(sizeof(Header) + _capacity);
+		}
+
+		void attach(void * _segment, quint32 _capacity, bool _init)
+		{
+			mHeader = static_cast<Header *>(_segment);
+			mData = static_cast<char *>(_segment) + sizeof(Header);
+
+			if (_init)
+			{
+				new (&mHeader->writePos) std::atomic<quint64>(0);
+				new (&mHeader->readPos) std::atomic<quint64>(0);
+				new (&mHeader->readerWaiting) std::atomic<quint32>(1);
+				new (&mHeader->writerWaiting) std::atomic<quint32>(0);
+				mHeader->capacity = _capacity;
+			}
+		}
+
+		bool isValid() const
+		{
+			return mHeader != nullptr;
+		}
+
+		quint32 capacity() const
+		{
+			return mHeader->capacity;
+		}
+
+		quint32 freeSpace() const
+		{
+			return mHeader->capacity - (quint32)(mHeader->writePos.load() - mHeader->readPos.load());
+		}
+
+		bool isEmpty() const
+		{
+			return mHeader->writePos.load() == mHeader->readPos.load();
+		}
+
+		// Producer side. A zero _length writes a fence record.
+		bool write(const char * _data, quint32 _length)
+		{
+			if (freeSpace() < _length + sizeof(quint32))
+				return false;
+
+			quint64 pos = mHeader->writePos.load(std::memory_order_relaxed);
+			copyIn(pos, reinterpret_cast<const char *>(&_length), sizeof(quint32));
+			if (_length > 0)
+				copyIn(pos + sizeof(quint32), _data, _length);
+
+			mHeader->writePos.store(pos + sizeof(quint32) + _length);
+			return true;
+		}
+
+		// Producer side. True when the consumer went idle and needs a doorbell on the pipe.
+		bool takeWakeRequest()
+		{
+			return mHeader->readerWaiting.exchange(0) != 0;
+		}
+
+		// Producer side. Announces the producer is waiting for _length bytes; false if the space is there meanwhile.
+		bool requestSpace(quint32 _length)
+		{
+			mHeader->writerWaiting.store(1);
+			return freeSpace() < _length + sizeof(quint32);
+		}
+
+		// Consumer side. True when the producer ran out of space and needs a doorbell on the pipe.
+		bool takeSpaceRequest()
+		{
+			return mHeader->writerWaiting.exchange(0) != 0;
+		}
+
+		// Consumer side.
+		bool read(QByteArray & _record, bool & _isFence)
+		{
+			if (isEmpty())
+				return false;
+
+			quint64 pos = mHeader->readPos.load(std::memory_order_relaxed);
+			quint32 length = 0;
+			copyOut(pos, reinterpret_cast<char *>(&length), sizeof(quint32));
+
+			_isFence = length == 0;
+			_record.resize(length);
+			if (length > 0)
+				copyOut(pos + sizeof(quint32), _record.data(), length);
+
+			mHeader->readPos.store(pos + sizeof(quint32) + length);
+			return true;
+		}
+
+		// Consumer side. Announces the consumer is going idle; false if records arrived meanwhile.
+		bool requestWake()
+		{
+			mHeader->readerWaiting.store(1);
+			return isEmpty();
+		}
+
+	private:
+		void copyIn(quint64 _pos, const char * _src, quint32 _length)
+		{
+			quint32 offset = (quint32)(_pos % mHeader->capacity);
+			quint32 first = qMin(_length, mHeader->capacity - offset);
+			memcpy(mData + offset, _src, first);
+			memcpy(mData, _src + first, _length - first);
+		}
+
+		void copyOut(quint64 _pos, char * _dst, quint32 _length) const
+		{
+			quint32 offset = (quint32)(_pos % mHeader->capacity);
+			quint32 first = qMin(_length, mHeader->capacity - offset);
+			memcpy(_dst, mData + offset, first);
+			memcpy(_dst + first, mData, _length - first);
+		}
+
+		Header * mHeader;
+		char * mData;
+	};
+
+	// Optional shared-memory lane between a process host and its child process, layered on binary framing.
+	// The host creates the segment and passes its key with ProcessArgSharedMemory; once a side announces
+	// PC_TRANSPORT(shm) on the pipe, every message it sends goes through its ring. Messages too large for
+	// the ring still travel over the pipe, fenced in the ring so the reader keeps the original order; the pipe
+	// marks them with PC_TRANSPORT(fenced), anything else on the pipe is delivered as it comes.
+	class ProcessTransport
+	{
+	public:
+		ProcessTransport(const QString & _key, bool _isHost, quint32 _capacity = DefaultCapacity)
+			: mMemory(_key),
+			mIsHost(_isHost),
+			mCapacity(_capacity),
+			mOutboundActive(false),
+			mInboundActive(false),
+			mAwaitingFence(false),
+			mPipeFenced(false),
+			mRingMessages(0),
+			mRingBytes(0),
+			mPipeMessages(0)
+		{
+		}
+
+		~ProcessTransport()
+		{
+			if (mMemory.isAttached())
+				mMemory.detach();
+		}
+
+		bool open()
+		{
+			int ringSize = SharedRingBuffer::segmentSize(mCapacity);
+
+			if (mIsHost)
+			{
+				if (!mMemory.create(ringSize * 2))
+					return false;
+			}
+			else if (!mMemory.attach())
+				return false;
+
+			char * segment = static_cast<char *>(mMemory.data());
+			SharedRingBuffer & hostToChild = mIsHost ? mOutbound : mInbound;
+			SharedRingBuffer & childToHost = mIsHost ? mInbound : mOutbound;
+			hostToChild.attach(segment, mCapacity, mIsHost);
+			childToHost.attach(segment + ringSize, mCapacity, mIsHost);
+
+			return true;
+		}
+
+		QString key() const
+		{
+			return mMemory.key();
+		}
+
+		bool isOutboundActive() const
+		{
+			return mOutboundActive;
+		}
+
+		bool hasBacklog() const
+		{
+			return !mBacklog.isEmpty();
+		}
+
+		quint64 ringMessages() const { return mRingMessages; }
+		quint64 ringBytes() const { return mRingBytes; }
+		quint64 pipeMessages() const { return mPipeMessages; }
+
+		// Starts writing into the ring and announces it to the peer.
+		void activate(QByteArray & _pipeOut)
+		{
+			if (mOutboundActive || !mOutbound.isValid())
+				return;
+
+			mOutboundActive = true;
+			_pipeOut.append(ComputeGridGlobals::makeProcessFrame(PC_TRANSPORT, QStringList() << TransportShm));
+		}
+
+		// Queues a binary frame; whatever has to go over the pipe is appended to _pipeOut.
+		void send(const QByteArray & _frame, QByteArray & _pipeOut)
+		{
+			mBacklog.enqueue(_frame);
+			flush(_pipeOut);
+		}
+
+		// Moves backlogged frames into the ring. What doesn't fit stays queued until the reader makes room and
+		// answers with PC_TRANSPORT(space), which receive() turns into another flush.
+		void flush(QByteArray & _pipeOut)
+		{
+			bool written = false;
+
+			while (!mBacklog.isEmpty())
+			{
+				const QByteArray & frame = mBacklog.head();
+				bool viaPipe = (quint32)frame.size() > mCapacity / 4;
+
+				if (viaPipe ? !mOutbound.write(nullptr, 0) : !mOutbound.write(frame.constData(), frame.size()))
+				{
+					if (mOutbound.requestSpace(viaPipe ? 0 : frame.size()))
+						break;
+
+					continue; // reader made room meanwhile
+				}
+
+				if (viaPipe)
+				{
+					_pipeOut.append(ComputeGridGlobals::makeProcessFrame(PC_TRANSPORT, QStringList() << TransportFenced));
+					_pipeOut.append(frame);
+					++mPipeMessages;
+				}
+				else
+				{
+					++mRingMessages;
+					mRingBytes += frame.size();
+				}
+
+				mBacklog.dequeue();
+				written = true;
+			}
+
+			if (written && mOutbound.takeWakeRequest())
+				_pipeOut.append(ComputeGridGlobals::makeProcessFrame(PC_TRANSPORT, QStringList() << TransportWake));
+		}
+
+		// Merges the messages read from the pipe with the ring records, in the order the peer sent them.
+		void receive(QList<ProcessMessage> & _pipeMessages, QList<ProcessMessage> & _messages, QByteArray & _pipeOut)
+		{
+			for (QList<ProcessMessage>::iterator it = _pipeMessages.begin(); it != _pipeMessages.end(); ++it)
+			{
+				if ((*it).command == PC_TRANSPORT && (*it).args.count() > 0)
+				{
+					if ((*it).args[0] == TransportShm)
+					{
+						mInboundActive = true;
+						if (mIsHost)
+							activate(_pipeOut);
+					}
+					else if ((*it).args[0] == TransportSpace)
+						flush(_pipeOut);
+					else if ((*it).args[0] == TransportFenced)
+						mPipeFenced = true;
+				}
+				else if (mPipeFenced)
+				{
+					mFencedMessages.enqueue(*it);
+					mPipeFenced = false;
+				}
+				else
+					_messages.append(*it);
+			}
+
+			if (mInboundActive)
+			{
+				drain(_messages);
+
+				if (mInbound.takeSpaceRequest())
+					_pipeOut.append(ComputeGridGlobals::makeProcessFrame(PC_TRANSPORT, QStringList() << TransportSpace));
+			}
+		}
+
+#pragma region Fields
+		static constexpr quint32 DefaultCapacity = 8 * 1024 * 1024;
+		static constexpr const char * TransportShm = "shm";
+		static constexpr const char * TransportWake = "wake";
+		static constexpr const char * TransportSpace = "space";
+		static constexpr const char * TransportFenced = "fenced";
+#pragma endregion
+
+	private:
+		void drain(QList<ProcessMessage> & _messages)
+		{
+			QByteArray record;
+			bool isFence = false;
+
+			while (true)
+			{
+				if (mAwaitingFence)
+				{
+					if (mFencedMessages.isEmpty())
+						return; // fenced message is still on its way through the pipe
+
+					_messages.append(mFencedMessages.dequeue());
+					mAwaitingFence = false;
+				}
+
+				if (!mInbound.read(record, isFence))
+				{
+					if (mInbound.requestWake())
+						return;
+
+					continue;
+				}
+
+				if (isFence)
+					mAwaitingFence = true;
+				else
+					ComputeGridGlobals::parseProcessMessages(record, _messages);
+			}
+		}
+
+		QSharedMemory mMemory;
+		SharedRingBuffer mOutbound;
+		SharedRingBuffer mInbound;
+		bool mIsHost;
+		quint32 mCapacity;
+		bool mOutboundActive;
+		bool mInboundActive;
+		bool mAwaitingFence;
+		bool mPipeFenced; // next message on the pipe has a fence in the ring
+		QQueue<QByteArray> mBacklog;
+		QQueue<ProcessMessage> mFencedMessages;
+		quint64 mRingMessages;
+		quint64 mRingBytes;
+		quint64 mPipeMessages;
+	};
+}
@@ -1,23 +1,50 @@
 #include "managerprocesshost.h"
+#include <QCoreApplication>
 #include <QDir>
 #include <QFile>
 #include <QMessageBox>
-#include <QtConcurrent/qtconcurrentrun.h>
+#include <QCryptographicHash>
 #include <QStandardPaths>
-#include "JlCompress.h"
+#include <QtConcurrent>
+#include "archiveextractor.hpp"
 
 using namespace ComputeGrid;
 
 ManagerProcessHost::ManagerProcessHost(int _keepAliveIntervalMs, QObject * _parent)
 	: QObject(_parent),
 	mProcess(nullptr),
+	mProcessTransport(nullptr),
+	mBinaryFraming(false),
+	mUseSharedMemory(false),
 	mNetServer(nullptr),
-	mKeepAliveIntervalMs(_keepAliveIntervalMs)
+	mKeepAliveIntervalMs(_keepAliveIntervalMs),
+	mFailureThreshold(8),
+	mProcessFraming(PF_TEXT),
+	mWorkerProcessSize(0),
+	mSwarmFanout(0),
+	mBatchMaxBytes(0),
+	mBatchLingerMs(2),
+	mBatchedMessages(0),
+	mBatchPackets(0),
+	mCompressionCodec(CC_NONE),
+	mCompressionThreshold(4096),
+	mCreditQueuedBytes(0),
+	mFlowControlMaxBytes(64 * 1024 * 1024),
+	mGridPaused(false)
 {
 	NetworkingGlobals::registerMetaTypes();
 
 	mKeepAliveTimer = new QTimer(this);
 	QObject::connect(mKeepAliveTimer, SIGNAL(timeout()), this, SLOT(keepAliveTimerTimeout()));
+
+	mBatchTimer = new QTimer(this);
+	mBatchTimer->setSingleShot(true);
+	QObject::connect(mBatchTimer, SIGNAL(timeout()), this, SLOT(batchTimerTimeout()));
+
+	mSpeculationTimer = new QTimer(this);
+	QObject::connect(mSpeculationTimer, SIGNAL(timeout()), this, SLOT(speculationTimerTimeout()));
+
+	mClock.start();
 }
 
 ManagerProcessHost::~ManagerProcessHost()
@@ -29,6 +56,16 @@ ManagerProcessHost::~ManagerProcessHost()
 		delete mKeepAliveTimer;
 
 	mKeepAliveTimer = nullptr;
+
+	if (mBatchTimer)
+		delete mBatchTimer;
+
+	mBatchTimer = nullptr;
+
+	if (mSpeculationTimer)
+		delete mSpeculationTimer;
+
+	mSpeculationTimer = nullptr;
 }
 
 bool ManagerProcessHost::startNetworkServer(quint16 _port, int _maxClients)
@@ -49,7 +86,10 @@ bool ManagerProcessHost::startNetworkServer(quint16 _port, int _maxClients)
 		mNetServer->setMaxClients(_maxClients);
 
 	if (res = mNetServer->startServer())
+	{
 		mKeepAliveTimer->start(mKeepAliveIntervalMs);
+		mSpeculationTimer->start(SpeculationIntervalMs);
+	}
 	
 	mNetworkMutex.unlock();
 
@@ -67,12 +107,58 @@ bool ManagerProcessHost::stopNetworkServer()
 		if (mKeepAliveTimer->isActive())
 			mKeepAliveTimer->stop();
 
+		if (mBatchTimer->isActive())
+			mBatchTimer->stop();
+
+		if (mSpeculationTimer->isActive())
+			mSpeculationTimer->stop();
+
+		mPendingBatches.clear();
+		mBatchingWorkers.clear();
+		mPendingSteals.clear();
+		mArchiveTransfers.clear();
+		mDeltaWaiting.clear();
+		mArchiveSeeders.clear();
+		mArchiveSources.clear();
+		mSwarmWaiting.clear();
+		mDetectors.clear();
+		mLastSentMs.clear();
+		mLastProbeMs.clear();
+		mSuspectedWorkers.clear();
+		mStaleTasks.clear();
+		mCreditQueues.clear();
+		mCreditQueuedBytes = 0;
+		mPausedWorkers.clear();
+		mGridPaused = false;
+
+		if (mBatchPackets > 0)
+			emit log(QString("Batching: %1 messages sent in %2 packets.").arg(mBatchedMessages).arg(mBatchPackets));
+
+		mBatchedMessages = 0;
+		mBatchPackets = 0;
+
 		if(mNetServer->isListening())
 			mNetServer->stopServer();
 
 		delete mNetServer;
 		mNetServer = nullptr;
 		res = true;
+
+		mWorkers.clear();
+
+		if (mScheduler.requeuedCount() > 0)
+			emit log(QString("Scheduler: %1 tasks reassigned after worker dropouts.").arg(mScheduler.requeuedCount()));
+
+		if (mScheduler.speculativeCount() > 0)
+			emit log(QString("Scheduler: %1 speculative copies of straggling tasks, %2 finished first.").arg(mScheduler.speculativeCount()).arg(mScheduler.speculativeWins()));
+
+		if (mScheduler.stolenCount() > 0)
+			emit log(QString("Scheduler: %1 tasks stolen by idle workers.").arg(mScheduler.stolenCount()));
+
+		if (mScheduler.queuedCount() + mScheduler.inFlightCount() > 0)
+			emit log(QString("Scheduler: %1 queued and %2 in-flight tasks dropped.").arg(mScheduler.queuedCount()).arg(mScheduler.inFlightCount()), LT_WARNING);
+
+		mScheduler.clear();
 	}
 
 	mNetworkMutex.unlock();
@@ -141,23 +227,43 @@ bool ManagerProcessHost::startProcess(quint16 _port, int _maxClients)
 
 	stopProcess();
 
+	// older manager.exe builds don't know the flags, they stay on the text protocol
+	QStringList args;
+	if (mBinaryFraming)
+		args << ComputeGridGlobals::ProcessArgBinaryFraming;
+
+	if (mBinaryFraming && mUseSharedMemory)
+	{
+		mProcessTransport = new ProcessTransport(QString("computegridmanager_%1").arg(QCoreApplication::applicationPid()), true);
+		if (mProcessTransport->open())
+			args << ComputeGridGlobals::ProcessArgSharedMemory << mProcessTransport->key();
+		else
+		{
+			emit log(QString("Shared-memory transport couldn't be created, using pipe only."), LT_WARNING);
+			delete mProcessTransport;
+			mProcessTransport = nullptr;
+		}
+	}
+
 	mProcessMutex.lock();
 
 	mProcess = new QProcess();
 	mProcess->setReadChannel(QProcess::StandardOutput);
 	QObject::connect(mProcess, SIGNAL(started()), this, SLOT(processStarted()));
 	QObject::connect(mProcess, SIGNAL(finished(int, QProcess::ExitStatus)), this, SLOT(processFinished(int, QProcess::ExitStatus)));
-	mProcess->setWorkingDirectory(QStandardPaths::writableLocation(QStandardPaths::AppDataLocation) + "/manager/");
-	mProcess->start(QStandardPaths::writableLocation(QStandardPaths::AppDataLocation) + "/manager/manager.exe", QStringList());
+	QObject::connect(mProcess, SIGNAL(readyReadStandardOutput()), this, SLOT(processReadyRead()));
+	ProcessInstallation install(QStandardPaths::writableLocation(QStandardPaths::AppDataLocation), "manager");
+	mProcess->setWorkingDirectory(install.currentDir() + "/");
+	mProcessReadBuffer.clear();
+	mProcessFraming = PF_TEXT; // switched to binary once manager.exe answers with a frame
+	mProcess->start(install.executable(), args);
 	res = mProcess->waitForStarted();
 
 	mProcessMutex.unlock();
 
 	res = startNetworkServer(_port, _maxClients);
 
-	if (res)
-		mProcessReadFuture = QtConcurrent::run(this, &ManagerProcessHost::readProcessAsync);
-	else
+	if (!res)
 		stopProcess();
 
 	return res;
@@ -169,9 +275,6 @@ bool ManagerProcessHost::stopProcess()
 
 	stopNetworkServer();
 
-	if (mProcessReadFuture.isRunning())
-		mProcessReadFuture.cancel();
-
 	mProcessMutex.lock();
 
 	if (mProcess)
@@ -189,57 +292,178 @@ bool ManagerProcessHost::stopProcess()
 		res = true;
 	}
 
+	if (mProcessTransport)
+	{
+		if (mProcessTransport->ringMessages() > 0)
+			emit log(QString("Shared-memory transport: %1 messages (%2 KB) through the ring, %3 large messages through the pipe.").arg(mProcessTransport->ringMessages()).arg(mProcessTransport->ringBytes() / 1024).arg(mProcessTransport->pipeMessages()));
+
+		delete mProcessTransport;
+		mProcessTransport = nullptr;
+	}
+
 	mProcessMutex.unlock();
 	
 	return res;
 }
 
-void ManagerProcessHost::writeToProcess(QString _cmd)
+void ManagerProcessHost::writeToProcess(ProcessCommand _pc, QStringList _args, const QByteArray & _data)
 {
+	bool dropped = false;
+
 	mProcessMutex.lock();
 
-	if(mProcess)
-		mProcess->write((_cmd.simplified() + ComputeGridGlobals::ProcessCommandSuffix).toLocal8Bit());
+	if (mProcess)
+	{
+		if (mProcessTransport && mProcessTransport->isOutboundActive())
+		{
+			QByteArray pipeOut;
+			mProcessTransport->send(ComputeGridGlobals::makeProcessFrame(_pc, _args, _data), pipeOut);
+
+			if (!pipeOut.isEmpty())
+				mProcess->write(pipeOut);
+		}
+		else if (mProcessFraming == PF_BINARY)
+			mProcess->write(ComputeGridGlobals::makeProcessFrame(_pc, _args, _data));
+		else if (_data.isEmpty())
+			mProcess->write(ComputeGridGlobals::makeProcessMessage(mProcessFraming, _pc, _args));
+		else
+			dropped = true;
+	}
 
 	mProcessMutex.unlock();
+
+	if (dropped)
+		emit log(QString("Raw data (%1 bytes) dropped, process doesn't support binary framing.").arg(_data.size()), LT_WARNING);
+}
+
+void ManagerProcessHost::setBinaryFraming(bool _enabled)
+{
+	mBinaryFraming = _enabled;
+}
+
+void ManagerProcessHost::setSharedMemoryTransport(bool _enabled)
+{
+	mUseSharedMemory = _enabled;
+}
+
+void ManagerProcessHost::setCompression(CompressionCodec _codec, int _thresholdBytes)
+{
+	mCompressionCodec = _codec;
+	mCompressionThreshold = qMax(0, _thresholdBytes);
+}
+
+void ManagerProcessHost::setTaskRetryLimit(int _retryLimit)
+{
+	mScheduler.setRetryLimit(_retryLimit);
+}
+
+void ManagerProcessHost::setSpeculation(double _budget, double _slowdown)
+{
+	mScheduler.setSpeculation(_budget, _slowdown);
+}
+
+void ManagerProcessHost::setWorkStealing(int _depth)
+{
+	mScheduler.setWorkStealing(_depth);
+}
+
+// Above _maxQueuedBytes held back for workers out of credit, manager.exe is asked to hold back new work.
+void ManagerProcessHost::setFlowControl(qint64 _maxQueuedBytes)
+{
+	mFlowControlMaxBytes = qMax<qint64>(1, _maxQueuedBytes);
+}
+
+void ManagerProcessHost::setLatencyAwareScheduling(int _bulkTaskBytes)
+{
+	mScheduler.setLatencyAware(_bulkTaskBytes);
+}
+
+// Workers are suspected once their silence reaches _phiThreshold; heartbeats go out every _heartbeatIntervalMs.
+void ManagerProcessHost::setFailureDetection(int _heartbeatIntervalMs, double _phiThreshold)
+{
+	mKeepAliveIntervalMs = qMax(100, _heartbeatIntervalMs);
+	mFailureThreshold = qMax(1.0, _phiThreshold);
+}
+
+// Workers holding the archive serve up to _fanout peers each, and so does the manager.
+void ManagerProcessHost::setSwarmDistribution(int _fanout)
+{
+	mSwarmFanout = qMax(0, _fanout);
+}
+
+void ManagerProcessHost::setBatching(int _maxBytes, int _lingerMs)
+{
+	flushBatches();
+
+	mBatchMaxBytes = _maxBytes;
+	mBatchLingerMs = qMax(0, _lingerMs);
 }
 
+// An archive loaded before is switched back to without extracting or testing it again.
 bool ManagerProcessHost::loadProcessArchive(QString _archiveFile, bool _isManagerProcess)
 {
 	QString msg;
 	bool res = false;
 
-	QDir dir(QStandardPaths::writableLocation(QStandardPaths::AppDataLocation) + (_isManagerProcess ? "/manager" : "/worker"));
-	if (
+	ProcessInstallation install(QStandardPaths::writableLocation(QStandardPaths::AppDataLocation), _isManagerProcess ? "manager" : "worker");
+	QString hash = ProcessInstallation::hashFile(_archiveFile);
+	bool extracted = !hash.isEmpty() && install.hasTree(hash);
+
+	QDir dir(install.stagingDir(hash));
+	if (hash.isEmpty())
+		msg = QString("File system I/O error! Archive:'%1' couldn't find.").arg(_archiveFile);
+	else if (!extracted && (
 		(dir.exists() && !dir.removeRecursively())
-		|| (!dir.exists() && !dir.mkpath(dir.absolutePath())))
+		|| (!dir.exists() && !dir.mkpath(dir.absolutePath()))))
 		msg = QString("File system I/O error! Directory:'%1' couldn't modify.").arg(dir.absolutePath());
-	else if (!QFile::exists(_archiveFile))
-		msg = QString("File system I/O error! Archive:'%1' couldn't find.").arg(_archiveFile);
 	else
 	{
-		QStringList files = JlCompress::extractDir(_archiveFile, dir.absolutePath());
-		if (files.isEmpty() || !files.contains(dir.absolutePath() + (_isManagerProcess ? "/manager.exe" : "/worker.exe")))
-			msg = QString("Archive error! '%1' is invalid, doesn't contain executable: %2").arg(_archiveFile).arg(_isManagerProcess ? "manager.exe" : "worker.exe");
-		else
+		if (!extracted)
+		{
+			QStringList files = ArchiveExtractor::extract(_archiveFile, dir.absolutePath());
+			if (files.isEmpty() || !files.contains(dir.absolutePath() + (_isManagerProcess ? "/manager.exe" : "/worker.exe")))
+				msg = QString("Archive error! '%1' is invalid, doesn't contain executable: %2").arg(_archiveFile).arg(_isManagerProcess ? "manager.exe" : "worker.exe");
+			else if (!install.commitTree(hash))
+				msg = QString("File system I/O error! Directory:'%1' couldn't modify.").arg(install.treeDir(hash));
+			else
+				extracted = true;
+		}
+
+		if (extracted)
 		{
-			QStringList args;
-			args.append("-test");
-			QProcess p;
-			p.start(dir.absolutePath() + (_isManagerProcess ? "/manager.exe" : "/worker.exe"), args);
-			
-			if (!p.waitForFinished(10000))
+			if (!install.isTested(hash))
 			{
-				p.kill();
-				msg = QString("Executable is timed out.");
+				QStringList args;
+				args.append("-test");
+				QProcess p;
+				p.start(install.treeDir(hash) + (_isManagerProcess ? "/manager.exe" : "/worker.exe"), args);
+
+				if (!p.waitForFinished(10000))
+				{
+					p.kill();
+					msg = QString("Executable is timed out.");
+				}
+				else if (p.exitCode() < 0)
+					msg = QString("Executable exited with code: %1.").arg(p.exitCode());
+				else
+					install.markTested(hash);
+
+				// a tree that fails its self-test never becomes current, the previous one stays in use
+				if (!msg.isEmpty())
+				{
+					emit log(msg, LT_ERROR);
+					return false; // RETURN!
+				}
 			}
-			else if (p.exitCode() < 0)
-				msg = QString("Executable exited with code: %1.").arg(p.exitCode());
 
-			res = msg.isEmpty();
+			if (install.setCurrent(hash))
+				install.prune(TreeCacheSize);
 
 			QString archiveAppData = QStandardPaths::writableLocation(QStandardPaths::AppDataLocation) + (_isManagerProcess ? "/manager.zip" : "/worker.zip");
-			
+
+			if (!_isManagerProcess)
+				mServedArchives.clear(); // a mapped file can't be replaced
+
 			if (QFile::exists(archiveAppData))
 				QFile::remove(archiveAppData);
 
@@ -270,13 +494,64 @@ bool ManagerProcessHost::loadProcessArchive(QString _archiveFile, bool _isManage
 
 bool ManagerProcessHost::attachWorkerArchive()
 {
-	mWorkerProcessData.clear();
-
+	mWorkerProcessFile.clear();
+	mWorkerProcessSize = 0;
+	mWorkerProcessHash.clear();
+	mWorkerProcessManifest.clear();
+	mServedArchives.clear();
+	mArchiveDeltas.clear();
+	mArchiveSeeders.clear(); // they hold the previous archive
+	mArchiveSources.clear();
+	QList<QPair<quint32, qint64>> waiting = mSwarmWaiting;
+	mSwarmWaiting.clear();
+	QList<quint32> transferring = mArchiveTransfers.keys(); // their chunks belong to the previous archive
+	mArchiveTransfers.clear();
+	for (QHash<QString, QList<quint32>>::const_iterator it = mDeltaWaiting.constBegin(); it != mDeltaWaiting.constEnd(); ++it)
+		transferring.append(it.value()); // their deltas are of the previous archive, the builds are dropped
+	mDeltaWaiting.clear();
+	QDir(workerDeltaPath()).removeRecursively();
+
+	// served in chunks straight from the file, never held in memory as a whole
 	QFile f(QStandardPaths::writableLocation(QStandardPaths::AppDataLocation) + "/Worker.zip");
 	if (f.open(QIODevice::ReadOnly))
 	{
-		mWorkerProcessData = f.readAll();
+		QCryptographicHash hash(QCryptographicHash::Sha256);
+		hash.addData(&f);
+		mWorkerProcessHash = hash.result().toHex();
+		mWorkerProcessSize = f.size();
+		mWorkerProcessFile = f.fileName();
 		f.close();
+
+		serveArchive(mWorkerProcessHash, mWorkerProcessFile);
+
+		// read from the central directory, without it every worker gets the whole archive
+		QuaZip zip(mWorkerProcessFile);
+		if (zip.open(QuaZip::mdUnzip))
+		{
+			QList<QuaZipFileInfo64> entries = zip.getFileInfoList64();
+			for (QList<QuaZipFileInfo64>::const_iterator it = entries.constBegin(); it != entries.constEnd(); ++it)
+			{
+				if (!(*it).name.endsWith('/'))
+					mWorkerProcessManifest.insert((*it).name, ComputeGridGlobals::makeManifestEntry((*it).name, (*it).crc, (*it).uncompressedSize));
+			}
+
+			zip.close();
+		}
+
+		for (QList<QPair<quint32, qint64>>::iterator it = waiting.begin(); it != waiting.end(); ++it)
+		{
+			WorkerInfo wi;
+			if (mWorkers.find((*it).first, &wi))
+				offerWorkerArchive(wi.client);
+		}
+
+		for (QList<quint32>::const_iterator it = transferring.constBegin(); it != transferring.constEnd(); ++it)
+		{
+			WorkerInfo wi;
+			if (mWorkers.find(*it, &wi))
+				offerWorkerArchive(wi.client);
+		}
+
 		return true;
 	}
 	else
@@ -285,208 +560,1301 @@ bool ManagerProcessHost::attachWorkerArchive()
 	return false;
 }
 
-void ManagerProcessHost::readProcessAsync()
+void ManagerProcessHost::handleProcessCommand(ComputeGrid::ProcessMessage & _message)
 {
-	bool run = true;
-	bool canRead = false;
-	while (run)
+	if (_message.framing == PF_BINARY && mProcessFraming != PF_BINARY)
 	{
-		canRead = false;
-		while (run && !canRead)
-		{
-			mProcessMutex.lock();
-			if (run = (mProcess && !mProcessReadFuture.isCanceled()))
-				canRead = mProcess->canReadLine();
-			mProcessMutex.unlock();
-		}
+		mProcessMutex.lock();
+		mProcessFraming = PF_BINARY;
+		mProcessMutex.unlock();
+	}
 
-		if (run)
-		{
-			QString cmd;
+	ProcessCommand pc = _message.command;
+	QStringList & args = _message.args;
 
-			mProcessMutex.lock();
-			if (mProcess)
-				cmd = mProcess->readLine();
-			mProcessMutex.unlock();
+	switch (pc)
+	{
+	case ComputeGrid::PC_WORKER_DATA:
+	case ComputeGrid::PC_WORKER_EXIT:
+	{
+		NetworkPacket np(NPT_DATA);
+		np.setTypeId(pc == PC_WORKER_DATA ? DPT_WORKER_DATA : DPT_WORKER_EXIT);
+		QDataStream ds(np.dataPtr(), QIODevice::WriteOnly);
+		ds << args;
 
-			if (!cmd.isEmpty())
-				QMetaObject::invokeMethod(this, "handleProcessCommand", Q_ARG(QString, cmd));
-		}
+		sendToWorker(args.first().toUInt(), np);
 	}
-}
-
-void ManagerProcessHost::handleProcessCommand(QString _command)
-{
-	ProcessCommand pc;
-	QStringList args;
+	break;
 
-	if (ComputeGridGlobals::parseProcessCommand(_command, pc, args))
+	case ComputeGrid::PC_WORKER_RAW_DATA:
 	{
-		switch (pc)
-		{
-		case ComputeGrid::PC_WORKER_DATA:
-		case ComputeGrid::PC_WORKER_EXIT:
-		{
-			NetworkPacket np(NPT_DATA);
-			np.setTypeId(pc == PC_WORKER_DATA ? DPT_WORKER_DATA : DPT_WORKER_EXIT);
-			QDataStream ds(np.dataPtr(), QIODevice::WriteOnly);
-			ds << args;
+		NetworkPacket np(NPT_DATA);
+		np.setTypeId(DPT_WORKER_RAW_DATA);
+		np.setData(_message.data);
 
-			NetworkClientInfo nci;
-			if (findWorkerClient(args.first(), &nci))
-			{
-				if (!sendPacket(np, nci))
-					emit log(QString("Network error: %1").arg(lastNetworkError()), LT_ERROR);
-			}
-			else
-				emit log(QString("Network client of worker %1 couldn't find.").arg(args.first()), LT_ERROR);
-		}
-		break;
+		sendToWorker(args.isEmpty() ? 0 : args.first().toUInt(), np);
+	}
+	break;
 
-		case ComputeGrid::PC_LOG:
-			emit log(args[2], (LogType)(args[1].toUInt()), (LogSource)(args[0].toUInt()));
+	case ComputeGrid::PC_TASK_SUBMIT:
+	{
+		if (args.isEmpty())
 			break;
 
-		case ComputeGrid::PC_STATUS_MESSAGE:
-			emit statusMessage(args[0]);
-			break;
+		Task task;
+		task.id = args.takeFirst();
+		task.args = args;
+		task.attempts = 0;
+		task.startedMs = 0;
 
-		default:
-			emit log("Unknown process command: " + _command, LT_WARNING);
+		if (!mScheduler.submit(task))
+		{
+			emit log(QString("Task %1 is rejected, a task with the same id is still queued or running.").arg(task.id), LT_ERROR);
+			writeToProcess(PC_TASK_FAILED, QStringList() << task.id << "0");
 			break;
 		}
+
+		dispatchTasks();
+	}
+	break;
+
+	case ComputeGrid::PC_WORKER_ADDRESS:
+	{
+		WorkerInfo wi;
+		if (args.isEmpty())
+			break;
+
+		writeToProcess(PC_WORKER_ADDRESS, QStringList() << args[0] << (mWorkers.find(args[0].toUInt(), &wi) ? wi.address : QString()));
+	}
+	break;
+
+	case ComputeGrid::PC_LOG:
+		emit log(args[2], (LogType)(args[1].toUInt()), (LogSource)(args[0].toUInt()));
+		break;
+
+	case ComputeGrid::PC_STATUS_MESSAGE:
+		emit statusMessage(args[0]);
+		break;
+
+	default:
+		emit log("Unknown process command: " + LiteralProcessCommand[pc], LT_WARNING);
+		break;
 	}
 }
 
-void ManagerProcessHost::keepAliveClients()
+bool ManagerProcessHost::sendToWorker(quint32 _workerId, NetworkPacket & _np)
 {
-	NetworkPacket np(NPT_DATA);
-	np.setTypeId(DPT_HEARTHBEAT);
-	np.setData(QByteArray::number(QDateTime::currentDateTime().toMSecsSinceEpoch()));
+	// older workers can't unpack batches
+	if (mBatchMaxBytes <= 0 || !mBatchingWorkers.contains(_workerId))
+		return sendToWorkerNow(_workerId, _np);
+
+	PendingBatch & pb = mPendingBatches[_workerId];
+	if (pb.data.isEmpty())
+	{
+		pb.count = 0;
+		pb.firstType = (DataPacketType)_np.typeId();
+		pb.firstData = *_np.dataPtr();
+	}
+
+	ComputeGridGlobals::appendBatchEntry(pb.data, (DataPacketType)_np.typeId(), *_np.dataPtr());
+	++pb.count;
+	++mBatchedMessages;
+
+	if (pb.data.size() >= mBatchMaxBytes)
+		return flushBatch(_workerId);
 
-	QList<NetworkClientInfo> & clients = networkClients();
-	for (QList<NetworkClientInfo>::iterator it = clients.begin(); it != clients.end(); ++it)
-		sendPacket(np, *it);
+	if (!mBatchTimer->isActive())
+		mBatchTimer->start(mBatchLingerMs);
+
+	return true;
 }
 
-bool ManagerProcessHost::findWorkerClient(const QString & _worker, NetworkClientInfo * _nci)
+bool ManagerProcessHost::flushBatch(quint32 _workerId)
 {
-	QList<NetworkClientInfo> & clients = networkClients();
-	for (QList<NetworkClientInfo>::iterator it = clients.begin(); it != clients.end(); ++it)
+	QHash<quint32, PendingBatch>::iterator it = mPendingBatches.find(_workerId);
+	if (it == mPendingBatches.end())
+		return true;
+
+	NetworkPacket np(NPT_DATA);
+	if (it.value().count == 1)
 	{
-		if ((*it).toString() == _worker)
-		{
-			if (_nci)
-			{
-				_nci->setAddress(it->getAddress());
-				_nci->setPort(it->getPort());
-			}
-			return true;
-		}
+		np.setTypeId(it.value().firstType);
+		np.setData(it.value().firstData);
+	}
+	else
+	{
+		np.setTypeId(DPT_WORKER_DATA_BATCH);
+		np.setData(it.value().data);
 	}
 
-	return false;
+	mPendingBatches.erase(it);
+	++mBatchPackets;
+
+	return sendToWorkerNow(_workerId, np);
 }
 
-#pragma region Slots
-void ManagerProcessHost::processStarted()
+void ManagerProcessHost::flushBatches()
 {
-	emit log("Process started.");
+	QList<quint32> workerIds = mPendingBatches.keys();
+	for (QList<quint32>::iterator it = workerIds.begin(); it != workerIds.end(); ++it)
+		flushBatch(*it);
 }
 
-void ManagerProcessHost::processFinished(int _exitCode, QProcess::ExitStatus _exitStatus)
+bool ManagerProcessHost::sendToWorkerNow(quint32 _workerId, NetworkPacket & _np)
 {
-	emit log(
-		QString("Process finished. Exit-Code:%1 (%2)").arg(_exitCode).arg(_exitStatus == QProcess::NormalExit ? "Normal Exit" : "Crash Exit"),
-		(_exitStatus == QProcess::NormalExit && _exitCode == 0) ? LT_INFO : LT_ERROR
-	);
+	WorkerInfo wi;
+	if (!mWorkers.find(_workerId, &wi))
+	{
+		emit log(QString("Network client of worker %1 couldn't find.").arg(_workerId), LT_ERROR);
+		return false;
+	}
 
-	if (isNetworkListening())
+	// out of credit, or older packets are still waiting: keep the order
+	QHash<quint32, QQueue<NetworkPacket>>::iterator cq = mCreditQueues.find(_workerId);
+	if (wi.creditLimited && (wi.credit <= 0 || (cq != mCreditQueues.end() && !cq.value().isEmpty())))
 	{
-		NetworkPacket np(NPT_DATA);
-		np.setTypeId(DPT_WORKER_EXIT);
+		mCreditQueues[_workerId].enqueue(_np);
+		mCreditQueuedBytes += _np.dataPtr()->size();
+		updateFlowControl(_workerId);
+		return true;
+	}
 
-		QList<NetworkClientInfo> & clients = networkClients();
-		for (QList<NetworkClientInfo>::iterator it = clients.begin(); it != clients.end(); ++it)
-		{
-			np.dataPtr()->clear();
+	qint64 sent = transmit(wi, _np);
+	if (sent < 0)
+		return false;
 
-			QDataStream ds(np.dataPtr(), QIODevice::WriteOnly);
-			ds << (QStringList() << (*it).toString());
-			sendPacket(np, *it);
-		}
-	}
+	mWorkers.consumeCredit(_workerId, sent);
+	return true;
 }
 
-void ManagerProcessHost::networkClientConnected(NetworkClientInfo _clientInfo)
+void ManagerProcessHost::drainCreditQueue(quint32 _workerId)
 {
-	emit log(QString("Grid-Worker: %1 is connected.").arg(_clientInfo.toString()));
+	QHash<quint32, QQueue<NetworkPacket>>::iterator cq = mCreditQueues.find(_workerId);
+	if (cq == mCreditQueues.end())
+		return;
 
-	NetworkPacket np(NPT_DATA);
-	np.setTypeId(DPT_GRID_ATTACH);
-	np.setData(mWorkerProcessData);
-	sendPacket(np, _clientInfo);
-}
+	WorkerInfo wi;
+	while (!cq.value().isEmpty() && mWorkers.find(_workerId, &wi) && (!wi.creditLimited || wi.credit > 0))
+	{
+		// a packet that couldn't be sent stays queued and counted
+		qint64 sent = transmit(wi, cq.value().head());
+		if (sent < 0)
+			break;
 
-void ManagerProcessHost::networkClientDisconnected(NetworkClientInfo _clientInfo)
-{
-	emit log(QString("Grid-Worker: %1 is disconnected.").arg(_clientInfo.toString()), LT_WARNING);
+		mCreditQueuedBytes -= cq.value().dequeue().dataPtr()->size();
+		mWorkers.consumeCredit(_workerId, sent);
+	}
 
-	writeToProcess(ComputeGridGlobals::makeProcessCommand(PC_GRID_WORKER_OUT, _clientInfo.toString()));
-	emit workerOutGrid(_clientInfo.toString());
+	if (cq.value().isEmpty())
+		mCreditQueues.erase(cq);
+
+	updateFlowControl(_workerId);
 }
 
-void ManagerProcessHost::networkClientError(NetworkClientInfo _clientInfo, QAbstractSocket::SocketError _socketError)
+void ManagerProcessHost::updateFlowControl(quint32 _workerId)
 {
-	emit log(QString("Grid-Worker: %1 threw network error: %2").arg(_clientInfo.toString()).arg((_socketError >= 0 && _socketError < LiteralSocketError.count()) ? LiteralSocketError[_socketError] : "Unknown Network Error"), LT_ERROR);
+	bool held = mCreditQueues.contains(_workerId);
+	if (held != mPausedWorkers.contains(_workerId))
+	{
+		if (held)
+			mPausedWorkers.insert(_workerId);
+		else
+			mPausedWorkers.remove(_workerId);
 
-	// to do: consider reinit the client?
+		writeToProcess(PC_FLOW_CONTROL, QStringList() << QString::number(_workerId) << (held ? "1" : "0"));
+	}
+
+	if (!mGridPaused && mCreditQueuedBytes > mFlowControlMaxBytes)
+	{
+		mGridPaused = true;
+		writeToProcess(PC_FLOW_CONTROL, QStringList() << "0" << "1");
+		emit log(QString("Flow control: %1 KB held back for slow workers, asking the manager process to hold back.").arg(mCreditQueuedBytes / 1024), LT_WARNING);
+	}
+	else if (mGridPaused && mCreditQueuedBytes <= mFlowControlMaxBytes / 2)
+	{
+		mGridPaused = false;
+		writeToProcess(PC_FLOW_CONTROL, QStringList() << "0" << "0");
+	}
 }
 
-void ManagerProcessHost::networkPacketReceived(NetworkClientInfo _clientInfo, NetworkPacket _packet)
+// Sends the packet compressed if that pays off; returns the bytes put on the wire, -1 on error.
+qint64 ManagerProcessHost::transmit(const WorkerInfo & _info, NetworkPacket & _np)
 {
-	DataPacketType dpt = (DataPacketType)_packet.typeId();
+	NetworkClientInfo client = _info.client;
 
-	QStringList args;
-	QDataStream ds(&_packet.data(), QIODevice::ReadOnly);
-	ds >> args;
+	if (_info.codec != CC_NONE && _np.dataPtr()->size() >= mCompressionThreshold)
+	{
+		QElapsedTimer et;
+		et.start();
 
-	switch (dpt)
+		QByteArray packed;
+		bool compressed = ComputeGridGlobals::compressPacketData(_info.codec, (DataPacketType)_np.typeId(), *_np.dataPtr(), packed);
+
+		// payloads that didn't shrink enough go out as they are, the time spent on them still counts
+		mWorkers.countCompression(_info.id, _np.dataPtr()->size(), compressed ? packed.size() : _np.dataPtr()->size(), et.nsecsElapsed());
+
+		if (compressed)
+		{
+
+			NetworkPacket np(NPT_DATA);
+			np.setTypeId(DPT_COMPRESSED);
+			np.setData(packed);
+
+			if (!sendPacket(np, client))
+			{
+				emit log(QString("Network error: %1").arg(lastNetworkError()), LT_ERROR);
+				return -1;
+			}
+
+			mWorkers.countSent(_info.id, packed.size());
+			mLastSentMs[_info.id] = mClock.elapsed();
+			return packed.size();
+		}
+	}
+
+	if (!sendPacket(_np, client))
 	{
-	case ComputeGrid::DPT_GRID_WORKER_READY:
-		args.insert(args.begin(), _clientInfo.toString());
-		writeToProcess(ComputeGridGlobals::makeProcessCommand(PC_GRID_WORKER_IN, args));
-		emit workerInGrid(_clientInfo.toString(), args.count() == 2 ? args[1].toInt() : 0);
-		break;
+		emit log(QString("Network error: %1").arg(lastNetworkError()), LT_ERROR);
+		return -1;
+	}
 
-	case ComputeGrid::DPT_WORKER_DATA:
-		args.insert(args.begin(), _clientInfo.toString());
-		writeToProcess(ComputeGridGlobals::makeProcessCommand(PC_WORKER_DATA, args));
-		break;
+	mWorkers.countSent(_info.id, _np.dataPtr()->size());
+	mLastSentMs[_info.id] = mClock.elapsed();
+	return _np.dataPtr()->size();
+}
 
-	case ComputeGrid::DPT_WORKER_EXIT:
-		args.insert(args.begin(), _clientInfo.toString());
-		writeToProcess(ComputeGridGlobals::makeProcessCommand(PC_WORKER_EXIT, args));
-		break;
+void ManagerProcessHost::dispatchTasks()
+{
+	sendTasks(mScheduler.dispatch());
+}
 
-	case ComputeGrid::DPT_LOG:
-		emit log(QString("(%1)%2").arg(_clientInfo.toString()).arg(args[2]), (LogType)(args[1].toUInt()), (LogSource)(args[0].toUInt()));
-		break;
+void ManagerProcessHost::sendTasks(const QList<QPair<quint32, Task>> & _assignments)
+{
+	for (QList<QPair<quint32, Task>>::const_iterator it = _assignments.constBegin(); it != _assignments.constEnd(); ++it)
+	{
+		NetworkPacket np(NPT_DATA);
+		np.setTypeId(DPT_TASK);
+		QDataStream ds(np.dataPtr(), QIODevice::WriteOnly);
+		ds << (QStringList() << (*it).second.id << (*it).second.args);
 
-	default:
-		emit log(QString("Unknown network packet from Grid-Worker: %1").arg(_clientInfo.toString()), LT_WARNING);
-		break;
+		sendToWorker((*it).first, np);
 	}
 }
 
-void ManagerProcessHost::networkError(QAbstractSocket::SocketError _socketError)
+void ManagerProcessHost::grantSteal(quint32 _thiefId, const QList<Task> & _tasks)
 {
-	emit log(QString("Socket error: %1").arg((_socketError >= 0 && _socketError < LiteralSocketError.count()) ? LiteralSocketError[_socketError] : "Unknown Network Error"), LT_ERROR);
+	QList<QPair<quint32, Task>> assignments;
+	for (QList<Task>::const_iterator it = _tasks.constBegin(); it != _tasks.constEnd(); ++it)
+		assignments.append(qMakePair(_thiefId, *it));
 
-	// to do: consider restart?
+	sendTasks(assignments);
+
+	NetworkPacket np(NPT_DATA);
+	np.setTypeId(DPT_STEAL_GRANT);
+	QDataStream ds(np.dataPtr(), QIODevice::WriteOnly);
+	ds << (QStringList() << QString::number(_tasks.count()));
+	sendToWorker(_thiefId, np);
 }
-void ManagerProcessHost::keepAliveTimerTimeout()
+
+void ManagerProcessHost::logWorkerStatistics(const WorkerInfo & _info)
 {
-	QMetaObject::invokeMethod(this, "keepAliveClients");
+	QString msg = QString("Grid-Worker: %1 sent %2 packets (%3 KB), received %4 packets (%5 KB).")
+		.arg(_info.address)
+		.arg(_info.packetsSent).arg(_info.bytesSent / 1024)
+		.arg(_info.packetsReceived).arg(_info.bytesReceived / 1024);
+
+	if (_info.compressionRawBytes > 0)
+		msg += QString(" Compression (%1): %2 KB -> %3 KB (ratio %4), %5 ms CPU.")
+			.arg(LiteralCompressionCodec[_info.codec])
+			.arg(_info.compressionRawBytes / 1024)
+			.arg(_info.compressionPackedBytes / 1024)
+			.arg((double)_info.compressionRawBytes / qMax<quint64>(1, _info.compressionPackedBytes), 0, 'f', 2)
+			.arg(_info.compressionNs / 1000000.0, 0, 'f', 1);
+
+	emit log(msg);
+}
+
+void ManagerProcessHost::keepAliveClients()
+{
+	qint64 now = mClock.elapsed();
+
+	NetworkPacket np(NPT_DATA);
+	np.setTypeId(DPT_HEARTHBEAT);
+	np.setData(QByteArray::number(now));
+
+	QList<quint32> workerIds = mWorkers.ids();
+	for (QList<quint32>::iterator it = workerIds.begin(); it != workerIds.end(); ++it)
+	{
+		QHash<quint32, PhiAccrualDetector>::const_iterator dit = mDetectors.constFind(*it);
+		if (dit != mDetectors.constEnd() && !mSuspectedWorkers.contains(*it))
+		{
+			double phi = dit.value().phi(now);
+			if (phi > mFailureThreshold)
+			{
+				suspectWorker(*it, phi);
+				continue;
+			}
+		}
+
+		// data sent recently already tells the worker we're alive; still probe now and then for RTT
+		if (now - mLastSentMs.value(*it, 0) < mKeepAliveIntervalMs
+			&& now - mLastProbeMs.value(*it, 0) < mKeepAliveIntervalMs * RttProbeIntervals)
+			continue;
+
+		WorkerInfo wi;
+		if (mWorkers.find(*it, &wi) && sendPacket(np, wi.client))
+		{
+			mLastSentMs[*it] = now;
+			mLastProbeMs[*it] = now;
+		}
+	}
+}
+
+// Workers with the archive in their cache start right away, the others ask for it.
+void ManagerProcessHost::offerWorkerArchive(NetworkClientInfo & _clientInfo)
+{
+	NetworkPacket np(NPT_DATA);
+	np.setTypeId(DPT_GRID_ATTACH_OFFER);
+	QDataStream ds(np.dataPtr(), QIODevice::WriteOnly);
+	ds << (QStringList() << mWorkerProcessHash << QString::number(mWorkerProcessSize));
+	sendPacket(np, _clientInfo);
+}
+
+void ManagerProcessHost::startArchiveTransfer(quint32 _workerId, NetworkClientInfo & _clientInfo, const QString & _hash, qint64 _offset)
+{
+	qint64 size = mServedArchives.value(_hash).size;
+
+	ArchiveTransfer t;
+	t.hash = _hash;
+	t.nextOffset = qBound<qint64>(0, _offset, size);
+	t.ackedOffset = t.nextOffset;
+	mArchiveTransfers.insert(_workerId, t);
+
+	if (t.nextOffset > 0)
+		emit log(QString("Grid-Worker: %1 resumes the worker archive at %2 of %3 KB.").arg(_clientInfo.toString()).arg(t.nextOffset / 1024).arg(size / 1024));
+	else if (t.hash == mWorkerProcessHash)
+		emit log(QString("Grid-Worker: %1 doesn't have the worker archive cached, sending %2 KB.").arg(_clientInfo.toString()).arg(size / 1024));
+
+	sendArchiveChunks(_workerId, _clientInfo);
+}
+
+// Keeps up to ArchiveWindowChunks unacknowledged chunks on the way.
+void ManagerProcessHost::sendArchiveChunks(quint32 _workerId, NetworkClientInfo & _clientInfo)
+{
+	QHash<quint32, ArchiveTransfer>::iterator it = mArchiveTransfers.find(_workerId);
+	if (it == mArchiveTransfers.end())
+		return;
+
+	ArchiveTransfer & t = it.value();
+	QHash<QString, ServedArchive>::iterator archive = mServedArchives.find(t.hash);
+	if (archive == mServedArchives.end())
+	{
+		mArchiveTransfers.erase(it); // replaced by a newer archive meanwhile
+
+		if (mServedArchives.contains(mWorkerProcessHash))
+			offerWorkerArchive(_clientInfo);
+		return;
+	}
+
+	ServedArchive & a = archive.value();
+	while (t.nextOffset < a.size && t.nextOffset - t.ackedOffset < (qint64)ComputeGridGlobals::ArchiveChunkSize * ComputeGridGlobals::ArchiveWindowChunks)
+	{
+		QByteArray chunk;
+		if (a.data)
+			chunk = QByteArray::fromRawData(reinterpret_cast<const char *>(a.data) + t.nextOffset, (int)qMin<qint64>(ComputeGridGlobals::ArchiveChunkSize, a.size - t.nextOffset));
+		else if (!a.mapping->seek(t.nextOffset) || (chunk = a.mapping->read(ComputeGridGlobals::ArchiveChunkSize)).isEmpty())
+		{
+			emit log(QString("File system I/O error! Archive:'%1' couldn't read at offset %2.").arg(a.file).arg(t.nextOffset), LT_ERROR);
+			mArchiveTransfers.erase(it);
+			break;
+		}
+
+		// resumes start at chunk boundaries, the workers' parts only grow by whole chunks
+		QString md5;
+		int index = (int)(t.nextOffset / ComputeGridGlobals::ArchiveChunkSize);
+		bool aligned = t.nextOffset % ComputeGridGlobals::ArchiveChunkSize == 0;
+		if (aligned && !a.chunkMd5[index].isEmpty())
+			md5 = a.chunkMd5[index];
+		else
+		{
+			md5 = QCryptographicHash::hash(chunk, QCryptographicHash::Md5).toHex();
+			if (aligned)
+				a.chunkMd5[index] = md5;
+		}
+
+		NetworkPacket np(NPT_DATA);
+		np.setTypeId(DPT_GRID_ATTACH_CHUNK);
+		QDataStream ds(np.dataPtr(), QIODevice::WriteOnly);
+		ds << (QStringList() << t.hash << QString::number(t.nextOffset) << md5);
+		ds << chunk;
+
+		if (!sendPacket(np, _clientInfo))
+			break;
+
+		t.nextOffset += chunk.size();
+	}
+}
+
+// Maps the archive once for every transfer of it; without a mapping chunks are read from the open file.
+bool ManagerProcessHost::serveArchive(const QString & _hash, const QString & _file)
+{
+	ServedArchive archive;
+	archive.file = _file;
+	archive.mapping = QSharedPointer<QFile>(new QFile(_file));
+	if (!archive.mapping->open(QIODevice::ReadOnly))
+	{
+		emit log(QString("File system I/O error! Archive:'%1' couldn't read.").arg(_file), LT_ERROR);
+		return false;
+	}
+
+	archive.size = archive.mapping->size();
+	archive.data = archive.size > 0 ? archive.mapping->map(0, archive.size) : nullptr;
+	if (!archive.data && archive.size > 0)
+		emit log(QString("Archive:'%1' couldn't be memory-mapped, it is read chunk by chunk.").arg(_file), LT_WARNING);
+
+	archive.chunkMd5.resize((int)((archive.size + ComputeGridGlobals::ArchiveChunkSize - 1) / ComputeGridGlobals::ArchiveChunkSize));
+	mServedArchives.insert(_hash, archive);
+	return true;
+}
+
+// Copies the entries a worker's installed files lack, still compressed, into a delta archive.
+// Runs on the thread pool: it touches nothing but the copies in _build and the delta directory.
+ManagerProcessHost::DeltaBuild ManagerProcessHost::buildWorkerArchiveDelta(DeltaBuild _build)
+{
+	ArchiveDelta & delta = _build.delta;
+	delta.hash.clear();
+	delta.changedFiles = 0;
+	delta.removedFiles.clear();
+	_build.ok = false;
+
+	QSet<QString> installed;
+	for (QStringList::const_iterator it = _build.manifest.constBegin(); it != _build.manifest.constEnd(); ++it)
+	{
+		installed.insert(*it);
+
+		QString path = ComputeGridGlobals::manifestEntryPath(*it);
+		if (!_build.archiveManifest.contains(path))
+			delta.removedFiles.append(path);
+	}
+
+	QSet<QString> changed;
+	for (QHash<QString, QString>::const_iterator it = _build.archiveManifest.constBegin(); it != _build.archiveManifest.constEnd(); ++it)
+	{
+		if (!installed.contains(it.value()))
+			changed.insert(it.key());
+	}
+
+	delta.changedFiles = changed.count();
+
+	if (changed.isEmpty())
+	{
+		_build.ok = true;
+		return _build;
+	}
+
+	QDir dir(_build.deltaPath);
+	if (!dir.exists() && !dir.mkpath(dir.absolutePath()))
+	{
+		_build.error = QString("File system I/O error! Directory:'%1' couldn't modify.").arg(dir.absolutePath());
+		return _build;
+	}
+
+	QString deltaFile = dir.absoluteFilePath(_build.key + ".tmp");
+	QuaZip src(_build.archiveFile);
+	QuaZip dst(deltaFile);
+	if (!src.open(QuaZip::mdUnzip) || !dst.open(QuaZip::mdCreate))
+	{
+		_build.error = QString("File system I/O error! Archive:'%1' couldn't create.").arg(deltaFile);
+		return _build;
+	}
+
+	bool res = true;
+	for (bool more = src.goToFirstFile(); more && res; more = src.goToNextFile())
+	{
+		QuaZipFileInfo64 info;
+		if (!src.getCurrentFileInfo(&info) || !changed.contains(info.name))
+			continue;
+
+		int method = 0;
+		int level = 0;
+		QuaZipFile in(&src);
+		QuaZipFile out(&dst);
+		res = in.open(QIODevice::ReadOnly, &method, &level, true)
+			&& out.open(QIODevice::WriteOnly, QuaZipNewInfo(info), nullptr, info.crc, method, level, true)
+			&& out.write(in.readAll()) >= 0;
+
+		in.close();
+		out.close();
+	}
+
+	src.close();
+	dst.close();
+
+	QFile f(deltaFile);
+	QCryptographicHash hash(QCryptographicHash::Sha256);
+	if (!res || !f.open(QIODevice::ReadOnly) || !hash.addData(&f))
+	{
+		QFile::remove(deltaFile);
+		_build.error = QString("Archive error! Delta of the worker archive couldn't create at: %1").arg(deltaFile);
+		return _build;
+	}
+
+	qint64 size = f.size();
+	f.close();
+
+	if (size >= _build.archiveSize)
+	{
+		// little in common, the whole archive replaces the installed files
+		QFile::remove(deltaFile);
+		delta.hash = _build.archiveHash;
+		delta.removedFiles.clear();
+		_build.ok = true;
+		return _build;
+	}
+
+	delta.hash = hash.result().toHex();
+	_build.deltaFile = dir.absoluteFilePath(delta.hash + ".zip");
+	QFile::remove(_build.deltaFile);
+	if (!QFile::rename(deltaFile, _build.deltaFile))
+	{
+		QFile::remove(deltaFile);
+		_build.deltaFile.clear();
+		_build.error = QString("File system I/O error! Archive:'%1' couldn't rename.").arg(deltaFile);
+		return _build;
+	}
+
+	_build.ok = true;
+	return _build;
+}
+
+// Workers on the same version send the same manifest, so a delta is built once for all of them;
+// the ones asking while it's being built wait for the same build.
+void ManagerProcessHost::requestWorkerArchiveDelta(quint32 _workerId, NetworkClientInfo & _clientInfo, const QStringList & _manifest)
+{
+	QStringList sorted = _manifest;
+	sorted.sort();
+	QString key = QCryptographicHash::hash(sorted.join('\n').toUtf8(), QCryptographicHash::Sha256).toHex();
+
+	if (mArchiveDeltas.contains(key))
+	{
+		sendWorkerArchiveDelta(_clientInfo, mArchiveDeltas.value(key));
+		return;
+	}
+
+	if (mWorkerProcessManifest.isEmpty())
+	{
+		sendWorkerArchiveDelta(_clientInfo, fullWorkerArchiveDelta());
+		return;
+	}
+
+	bool building = mDeltaWaiting.contains(key);
+	mDeltaWaiting[key].append(_workerId);
+	if (building)
+		return;
+
+	DeltaBuild build;
+	build.key = key;
+	build.manifest = _manifest;
+	build.archiveHash = mWorkerProcessHash;
+	build.archiveFile = mWorkerProcessFile;
+	build.archiveSize = mWorkerProcessSize;
+	build.archiveManifest = mWorkerProcessManifest;
+	build.deltaPath = workerDeltaPath();
+	build.ok = false;
+
+	QFutureWatcher<DeltaBuild> * watcher = new QFutureWatcher<DeltaBuild>(this);
+	QObject::connect(watcher, SIGNAL(finished()), this, SLOT(deltaBuildFinished()));
+	watcher->setFuture(QtConcurrent::run(&ManagerProcessHost::buildWorkerArchiveDelta, build));
+}
+
+void ManagerProcessHost::sendWorkerArchiveDelta(NetworkClientInfo & _clientInfo, const ArchiveDelta & _delta)
+{
+	qint64 size = _delta.hash.isEmpty() ? 0 : mServedArchives.value(_delta.hash).size;
+	if (_delta.hash != mWorkerProcessHash)
+		emit log(QString("Grid-Worker: %1 gets a %2 KB delta of the worker archive, %3 files changed, %4 removed.").arg(_clientInfo.toString()).arg(size / 1024).arg(_delta.changedFiles).arg(_delta.removedFiles.count()));
+
+	NetworkPacket np(NPT_DATA);
+	np.setTypeId(DPT_GRID_ATTACH_DELTA);
+	QDataStream ds(np.dataPtr(), QIODevice::WriteOnly);
+	ds << (QStringList() << mWorkerProcessHash << _delta.hash << QString::number(size) << _delta.removedFiles);
+	sendPacket(np, _clientInfo);
+}
+
+ManagerProcessHost::ArchiveDelta ManagerProcessHost::fullWorkerArchiveDelta()
+{
+	ArchiveDelta delta;
+	delta.hash = mWorkerProcessHash;
+	delta.changedFiles = mWorkerProcessManifest.count();
+	return delta;
+}
+
+// Seeders take the download first, so the manager's uplink is left to those nobody else can serve.
+// Every finished download adds a seeder, the number of sources grows with each round.
+bool ManagerProcessHost::assignArchiveSource(quint32 _workerId, qint64 _offset)
+{
+	WorkerInfo wi;
+	if (!mWorkers.find(_workerId, &wi))
+		return true; // gone, nothing to wait for
+
+	quint32 seederId = 0;
+	int uploads = mSwarmFanout;
+	for (QHash<quint32, ArchiveSeeder>::const_iterator it = mArchiveSeeders.constBegin(); it != mArchiveSeeders.constEnd(); ++it)
+	{
+		if (it.key() != _workerId && it.value().uploads < uploads)
+		{
+			seederId = it.key();
+			uploads = it.value().uploads;
+		}
+	}
+
+	if (seederId != 0)
+	{
+		ArchiveSeeder & seeder = mArchiveSeeders[seederId];
+		++seeder.uploads;
+		mArchiveSources.insert(_workerId, seederId);
+
+		emit log(QString("Grid-Worker: %1 fetches the worker archive from its peer %2:%3.").arg(wi.address).arg(seeder.address).arg(seeder.port));
+
+		NetworkPacket np(NPT_DATA);
+		np.setTypeId(DPT_GRID_ATTACH_PEER);
+		QDataStream ds(np.dataPtr(), QIODevice::WriteOnly);
+		ds << (QStringList() << mWorkerProcessHash << seeder.address << QString::number(seeder.port) << QString::number(mWorkerProcessSize));
+		sendPacket(np, wi.client);
+		return true;
+	}
+
+	if (mArchiveSources.keys(0).count() < mSwarmFanout)
+	{
+		mArchiveSources.insert(_workerId, 0);
+		startArchiveTransfer(_workerId, wi.client, mWorkerProcessHash, _offset);
+		return true;
+	}
+
+	return false;
+}
+
+void ManagerProcessHost::releaseArchiveSource(quint32 _workerId, bool _sourceFailed)
+{
+	QHash<quint32, quint32>::iterator it = mArchiveSources.find(_workerId);
+	if (it == mArchiveSources.end())
+		return;
+
+	quint32 seederId = it.value();
+	mArchiveSources.erase(it);
+
+	QHash<quint32, ArchiveSeeder>::iterator seeder = mArchiveSeeders.find(seederId);
+	if (seederId == 0)
+		mArchiveTransfers.remove(_workerId);
+	else if (seeder != mArchiveSeeders.end())
+	{
+		if (_sourceFailed)
+		{
+			emit log(QString("Grid-Worker: peer %1:%2 couldn't serve the worker archive, it no longer seeds.").arg(seeder.value().address).arg(seeder.value().port), LT_WARNING);
+			mArchiveSeeders.erase(seeder);
+		}
+		else
+			--seeder.value().uploads;
+	}
+
+	assignWaitingDownloads();
+}
+
+void ManagerProcessHost::assignWaitingDownloads()
+{
+	while (!mSwarmWaiting.isEmpty() && assignArchiveSource(mSwarmWaiting.first().first, mSwarmWaiting.first().second))
+		mSwarmWaiting.removeFirst();
+}
+
+QString ManagerProcessHost::workerDeltaPath()
+{
+	return QStandardPaths::writableLocation(QStandardPaths::AppDataLocation) + "/deltas";
+}
+
+// Takes the worker out of scheduling; its in-flight tasks go to the others.
+void ManagerProcessHost::releaseWorker(quint32 _workerId)
+{
+	// thieves waiting on this worker won't get an answer
+	QQueue<quint32> thieves = mPendingSteals.take(_workerId);
+	while (!thieves.isEmpty())
+		grantSteal(thieves.dequeue(), QList<Task>());
+
+	QList<Task> failed = mScheduler.removeWorker(_workerId);
+	for (QList<Task>::iterator it = failed.begin(); it != failed.end(); ++it)
+	{
+		emit log(QString("Task %1 failed, %2 workers dropped out while running it.").arg((*it).id).arg((*it).attempts), LT_ERROR);
+		writeToProcess(PC_TASK_FAILED, QStringList() << (*it).id << QString::number((*it).attempts));
+	}
+
+	writeToProcess(PC_GRID_WORKER_OUT, QStringList() << QString::number(_workerId));
+
+	dispatchTasks();
+}
+
+void ManagerProcessHost::suspectWorker(quint32 _workerId, double _phi)
+{
+	WorkerInfo wi;
+	if (!mWorkers.find(_workerId, &wi))
+		return;
+
+	emit log(QString("Grid-Worker: %1 is suspected to be down (phi %2), its tasks are reassigned.").arg(wi.address).arg(_phi, 0, 'f', 1), LT_WARNING);
+
+	mSuspectedWorkers.insert(_workerId);
+	mStaleTasks.insert(_workerId, mScheduler.inFlightIds(_workerId));
+	releaseWorker(_workerId);
+
+	emit workerOutGrid(wi.address);
+}
+
+// A suspected worker was heard from again; it gets new tasks, the reassigned ones stay where they are.
+// Its copies of them are cancelled first, it comes back with free slots and no task runs twice.
+void ManagerProcessHost::rejoinWorker(quint32 _workerId)
+{
+	WorkerInfo wi;
+	QStringList staleTasks = mStaleTasks.take(_workerId);
+	if (!mSuspectedWorkers.remove(_workerId) || !mWorkers.find(_workerId, &wi))
+		return;
+
+	emit log(QString("Grid-Worker: %1 is responsive again, %2 reassigned tasks are cancelled on it.").arg(wi.address).arg(staleTasks.count()));
+
+	for (QStringList::iterator it = staleTasks.begin(); it != staleTasks.end(); ++it)
+	{
+		NetworkPacket np(NPT_DATA);
+		np.setTypeId(DPT_TASK_CANCEL);
+		QDataStream dsOut(np.dataPtr(), QIODevice::WriteOnly);
+		dsOut << (QStringList() << *it);
+		sendToWorker(_workerId, np);
+	}
+
+	writeToProcess(PC_GRID_WORKER_IN, QStringList() << QString::number(_workerId) << QString::number(wi.capacity) << wi.address);
+	emit workerInGrid(wi.address, wi.capacity);
+
+	mScheduler.addWorker(_workerId, wi.capacity, wi.prefetch);
+	if (wi.srttMs >= 0)
+		mScheduler.setWorkerRtt(_workerId, wi.srttMs);
+
+	dispatchTasks();
+}
+
+#pragma region Slots
+void ManagerProcessHost::processReadyRead()
+{
+	QList<ProcessMessage> messages;
+
+	mProcessMutex.lock();
+	if (mProcess)
+	{
+		mProcessReadBuffer.append(mProcess->readAllStandardOutput());
+
+		if (mProcessTransport)
+		{
+			QList<ProcessMessage> pipeMessages;
+			QByteArray pipeOut;
+			ComputeGridGlobals::parseProcessMessages(mProcessReadBuffer, pipeMessages);
+			mProcessTransport->receive(pipeMessages, messages, pipeOut);
+
+			if (!pipeOut.isEmpty())
+				mProcess->write(pipeOut);
+		}
+		else
+			ComputeGridGlobals::parseProcessMessages(mProcessReadBuffer, messages);
+	}
+	mProcessMutex.unlock();
+
+	for (QList<ProcessMessage>::iterator it = messages.begin(); it != messages.end(); ++it)
+		handleProcessCommand(*it);
+}
+
+void ManagerProcessHost::processStarted()
+{
+	emit log("Process started.");
+}
+
+void ManagerProcessHost::processFinished(int _exitCode, QProcess::ExitStatus _exitStatus)
+{
+	emit log(
+		QString("Process finished. Exit-Code:%1 (%2)").arg(_exitCode).arg(_exitStatus == QProcess::NormalExit ? "Normal Exit" : "Crash Exit"),
+		(_exitStatus == QProcess::NormalExit && _exitCode == 0) ? LT_INFO : LT_ERROR
+	);
+
+	if (isNetworkListening())
+	{
+		flushBatches();
+
+		// credited like every other DPT_WORKER_EXIT, queued behind whatever the worker has no credit for yet
+		QList<quint32> workerIds = mWorkers.ids();
+		for (QList<quint32>::iterator it = workerIds.begin(); it != workerIds.end(); ++it)
+		{
+			NetworkPacket np(NPT_DATA);
+			np.setTypeId(DPT_WORKER_EXIT);
+
+			QDataStream ds(np.dataPtr(), QIODevice::WriteOnly);
+			ds << (QStringList() << QString::number(*it));
+			sendToWorkerNow(*it, np);
+		}
+	}
+}
+
+void ManagerProcessHost::networkClientConnected(NetworkClientInfo _clientInfo)
+{
+	emit log(QString("Grid-Worker: %1 is connected.").arg(_clientInfo.toString()));
+
+	mWorkers.add(_clientInfo);
+
+	offerWorkerArchive(_clientInfo);
+}
+
+void ManagerProcessHost::networkClientDisconnected(NetworkClientInfo _clientInfo)
+{
+	emit log(QString("Grid-Worker: %1 is disconnected.").arg(_clientInfo.toString()), LT_WARNING);
+
+	quint32 workerId = mWorkers.idOf(_clientInfo.toString());
+	if (workerId != 0)
+	{
+		WorkerInfo wi;
+		mPendingBatches.remove(workerId);
+		mBatchingWorkers.remove(workerId);
+
+		QHash<quint32, QQueue<NetworkPacket>>::iterator cq = mCreditQueues.find(workerId);
+		if (cq != mCreditQueues.end())
+		{
+			for (QQueue<NetworkPacket>::iterator it = cq.value().begin(); it != cq.value().end(); ++it)
+				mCreditQueuedBytes -= (*it).dataPtr()->size();
+
+			mCreditQueues.erase(cq);
+		}
+
+		updateFlowControl(workerId);
+
+		mArchiveTransfers.remove(workerId);
+		mArchiveSeeders.remove(workerId);
+
+		// whoever was fetching from it asks again and gets another source
+		QList<quint32> downloaders = mArchiveSources.keys(workerId);
+		for (QList<quint32>::iterator it = downloaders.begin(); it != downloaders.end(); ++it)
+			releaseArchiveSource(*it, true);
+
+		for (int i = mSwarmWaiting.count() - 1; i >= 0; --i)
+		{
+			if (mSwarmWaiting[i].first == workerId)
+				mSwarmWaiting.removeAt(i);
+		}
+		releaseArchiveSource(workerId, false);
+		mDetectors.remove(workerId);
+		mLastSentMs.remove(workerId);
+		mLastProbeMs.remove(workerId);
+
+		mStaleTasks.remove(workerId);
+		if (!mSuspectedWorkers.remove(workerId))
+			releaseWorker(workerId);
+
+		if (mWorkers.remove(workerId, &wi))
+			logWorkerStatistics(wi);
+	}
+
+	emit workerOutGrid(_clientInfo.toString());
+}
+
+void ManagerProcessHost::networkClientError(NetworkClientInfo _clientInfo, QAbstractSocket::SocketError _socketError)
+{
+	emit log(QString("Grid-Worker: %1 threw network error: %2").arg(_clientInfo.toString()).arg((_socketError >= 0 && _socketError < LiteralSocketError.count()) ? LiteralSocketError[_socketError] : "Unknown Network Error"), LT_ERROR);
+
+	// to do: consider reinit the client?
+}
+
+void ManagerProcessHost::networkPacketReceived(NetworkClientInfo _clientInfo, NetworkPacket _packet)
+{
+	// the handle is resolved once per packet, batched and compressed payloads reuse it
+	quint32 workerId = mWorkers.countReceived(_clientInfo.toString(), _packet.dataPtr()->size());
+
+	QHash<quint32, PhiAccrualDetector>::iterator dit = mDetectors.find(workerId);
+	if (dit != mDetectors.end())
+	{
+		// only heartbeats and probe echoes are interval samples, other traffic just shows the worker is alive
+		if (_packet.typeId() == DPT_HEARTHBEAT)
+			dit.value().heartbeat(mClock.elapsed());
+		else
+			dit.value().seen(mClock.elapsed());
+
+		if (mSuspectedWorkers.contains(workerId))
+			rejoinWorker(workerId);
+	}
+
+	handleDataPacket(_clientInfo, workerId, _packet);
+}
+
+void ManagerProcessHost::handleDataPacket(NetworkClientInfo & _clientInfo, quint32 _workerId, NetworkPacket & _packet)
+{
+	DataPacketType dpt = (DataPacketType)_packet.typeId();
+
+	QStringList args;
+	QDataStream ds(&_packet.data(), QIODevice::ReadOnly);
+	if (dpt != DPT_HEARTHBEAT && dpt != DPT_WORKER_RAW_DATA && dpt != DPT_WORKER_DATA_BATCH && dpt != DPT_COMPRESSED)
+		ds >> args;
+
+	switch (dpt)
+	{
+	case ComputeGrid::DPT_GRID_WORKER_READY:
+	{
+		int capacity = args.count() > 0 ? args[0].toInt() : 0;
+		int prefetch = args.count() > 2 ? args[2].toInt() : 0;
+		mWorkers.setCapacity(_workerId, capacity, prefetch);
+
+		if (args.count() > 5 && args[5] == "1")
+			mBatchingWorkers.insert(_workerId);
+
+		// the window is in place before anything flow controlled is sent, the config included
+		if (args.count() > 6)
+			mWorkers.setCreditWindow(_workerId, args[6].toLongLong());
+
+		if (args.count() > 1)
+		{
+			// new workers list their codecs; agree on ours if they have it, otherwise stay uncompressed
+			CompressionCodec codec = args[1].split(',').contains(LiteralCompressionCodec[mCompressionCodec]) ? mCompressionCodec : CC_NONE;
+
+			NetworkPacket np(NPT_DATA);
+			np.setTypeId(DPT_GRID_CONFIG);
+			QDataStream dsOut(np.dataPtr(), QIODevice::WriteOnly);
+			dsOut << (QStringList() << LiteralCompressionCodec[codec] << QString::number(mCompressionThreshold) << (mScheduler.isWorkStealing() ? "1" : "0") << QString::number(mKeepAliveIntervalMs) << "1");
+			sendToWorkerNow(_workerId, np);
+
+			mWorkers.setCodec(_workerId, codec);
+		}
+
+		writeToProcess(PC_GRID_WORKER_IN, QStringList() << QString::number(_workerId) << QString::number(capacity) << _clientInfo.toString());
+		emit workerInGrid(_clientInfo.toString(), capacity);
+
+		QList<Task> failed = mScheduler.addWorker(_workerId, capacity, prefetch);
+		for (QList<Task>::iterator it = failed.begin(); it != failed.end(); ++it)
+		{
+			emit log(QString("Task %1 failed, %2 workers dropped out while running it.").arg((*it).id).arg((*it).attempts), LT_ERROR);
+			writeToProcess(PC_TASK_FAILED, QStringList() << (*it).id << QString::number((*it).attempts));
+		}
+
+		releaseArchiveSource(_workerId, false);
+		if (mSwarmFanout > 0 && args.count() > 3 && args[3].toUInt() > 0)
+		{
+			ArchiveSeeder seeder;
+			seeder.address = _clientInfo.toString().section(':', 0, -2);
+			seeder.port = args[3].toUShort();
+			seeder.uploads = 0;
+			mArchiveSeeders.insert(_workerId, seeder);
+			assignWaitingDownloads();
+		}
+
+		// attach and extraction are over, the worker answers heartbeats from now on
+		mDetectors.insert(_workerId, PhiAccrualDetector(mKeepAliveIntervalMs));
+		mDetectors[_workerId].heartbeat(mClock.elapsed());
+		dispatchTasks();
+	}
+	break;
+
+	case ComputeGrid::DPT_TASK_FAILED:
+	{
+		int lost = 0;
+		QList<Task> failed = mScheduler.fail(_workerId, args, &lost);
+		for (QList<Task>::iterator it = failed.begin(); it != failed.end(); ++it)
+		{
+			emit log(QString("Task %1 failed, %2 workers lost it.").arg((*it).id).arg((*it).attempts), LT_ERROR);
+			writeToProcess(PC_TASK_FAILED, QStringList() << (*it).id << QString::number((*it).attempts));
+		}
+
+		emit log(QString("Grid-Worker: %1 lost %2 tasks with a crashed worker process, %3 of them are out of retries.").arg(_clientInfo.toString()).arg(lost).arg(failed.count()), LT_WARNING);
+		dispatchTasks();
+	}
+	break;
+
+	case ComputeGrid::DPT_WORKER_SLOTS:
+	{
+		WorkerInfo wi;
+		if (args.isEmpty() || !mWorkers.find(_workerId, &wi))
+			break;
+
+		mWorkers.setCapacity(_workerId, args[0].toInt(), wi.prefetch);
+		mScheduler.setCapacity(_workerId, args[0].toInt());
+		emit log(QString("Grid-Worker: %1 runs with %2 task slots now.").arg(_clientInfo.toString()).arg(args[0].toInt()), LT_WARNING);
+		dispatchTasks();
+	}
+	break;
+
+	case ComputeGrid::DPT_TASK_RESULT:
+	{
+		QList<quint32> cancelled;
+		if (args.isEmpty() || !mScheduler.complete(_workerId, args[0], &cancelled))
+			break; // a speculative copy lost the race or the task is unknown
+
+		for (QList<quint32>::iterator it = cancelled.begin(); it != cancelled.end(); ++it)
+		{
+			NetworkPacket np(NPT_DATA);
+			np.setTypeId(DPT_TASK_CANCEL);
+			QDataStream dsOut(np.dataPtr(), QIODevice::WriteOnly);
+			dsOut << (QStringList() << args[0]);
+			sendToWorker(*it, np);
+		}
+
+		args.insert(1, QString::number(_workerId));
+		writeToProcess(PC_TASK_RESULT, args);
+
+		dispatchTasks();
+	}
+	break;
+
+	case ComputeGrid::DPT_STEAL_REQUEST:
+	{
+		dispatchTasks();
+
+		int surplus = 0;
+		quint32 victimId = mScheduler.stealVictim(_workerId, &surplus);
+		if (victimId == 0)
+		{
+			grantSteal(_workerId, QList<Task>());
+			break;
+		}
+
+		// steal half of the victim's backlog, no more than the thief can run
+		int count = qMin(qMax(1, surplus / 2), args.count() > 0 ? qMax(1, args[0].toInt()) : 1);
+		mPendingSteals[victimId].enqueue(_workerId);
+
+		NetworkPacket np(NPT_DATA);
+		np.setTypeId(DPT_STEAL_REVOKE);
+		QDataStream dsOut(np.dataPtr(), QIODevice::WriteOnly);
+		dsOut << (QStringList() << QString::number(count));
+		sendToWorker(victimId, np);
+	}
+	break;
+
+	case ComputeGrid::DPT_STEAL_REVOKE:
+	{
+		QHash<quint32, QQueue<quint32>>::iterator it = mPendingSteals.find(_workerId);
+		if (it == mPendingSteals.end() || it.value().isEmpty())
+			break;
+
+		quint32 thiefId = it.value().dequeue();
+		if (it.value().isEmpty())
+			mPendingSteals.erase(it);
+
+		WorkerInfo wi;
+		if (mWorkers.find(thiefId, &wi))
+			grantSteal(thiefId, mScheduler.steal(_workerId, thiefId, args));
+		else
+		{
+			mScheduler.steal(_workerId, thiefId, args);
+			dispatchTasks();
+		}
+	}
+	break;
+
+	case ComputeGrid::DPT_HEARTHBEAT:
+	{
+		if (_packet.data().isEmpty())
+			break; // idle worker's own heartbeat, counted by the failure detector
+
+		// echo of our own timestamp, so both ends of the sample use the manager's monotonic clock
+		double sampleMs = (double)(mClock.elapsed() - _packet.data().toLongLong());
+		double srttMs = 0;
+		double rttVarMs = 0;
+		if (sampleMs >= 0 && mWorkers.updateRtt(_workerId, sampleMs, &srttMs, &rttVarMs))
+		{
+			mScheduler.setWorkerRtt(_workerId, srttMs);
+			emit workerLatency(_clientInfo.toString(), srttMs, rttVarMs);
+		}
+	}
+	break;
+
+	case ComputeGrid::DPT_GRID_ATTACH_MANIFEST:
+		if (args.isEmpty() || args[0] != mWorkerProcessHash)
+		{
+			offerWorkerArchive(_clientInfo); // archive changed since the offer
+			break;
+		}
+
+		requestWorkerArchiveDelta(_workerId, _clientInfo, args.mid(1));
+		break;
+
+	case ComputeGrid::DPT_GRID_ATTACH_REQUEST:
+		if (args.isEmpty() || !mServedArchives.contains(args[0]))
+		{
+			offerWorkerArchive(_clientInfo); // archive changed since the offer
+			break;
+		}
+
+		if (mSwarmFanout > 0 && args[0] == mWorkerProcessHash)
+		{
+			// p3=1: the peer it was sent to failed, it resumes from here
+			qint64 offset = args.count() > 1 ? args[1].toLongLong() : 0;
+			releaseArchiveSource(_workerId, args.count() > 2 && args[2] == "1");
+
+			if (!assignArchiveSource(_workerId, offset))
+			{
+				mSwarmWaiting.append(qMakePair(_workerId, offset));
+				emit log(QString("Grid-Worker: %1 waits for a free worker archive source, %2 ahead.").arg(_clientInfo.toString()).arg(mSwarmWaiting.count() - 1));
+			}
+			break;
+		}
+
+		startArchiveTransfer(_workerId, _clientInfo, args[0], args.count() > 1 ? args[1].toLongLong() : 0);
+		break;
+
+	case ComputeGrid::DPT_GRID_ATTACH_ACK:
+	{
+		QHash<quint32, ArchiveTransfer>::iterator it = mArchiveTransfers.find(_workerId);
+		if (args.count() < 3)
+			break;
+
+		if (it == mArchiveTransfers.end())
+		{
+			// a peer served it, that upload slot is free again
+			if (mArchiveSources.contains(_workerId) && args[0] == mWorkerProcessHash && args[1].toLongLong() >= mWorkerProcessSize)
+				releaseArchiveSource(_workerId, false);
+			break;
+		}
+
+		if (args[0] != it.value().hash)
+			break;
+
+		qint64 offset = args[1].toLongLong();
+		if (args[2] == "1")
+		{
+			// corrupt chunk, go back to it
+			it.value().nextOffset = offset;
+			it.value().ackedOffset = offset;
+		}
+		else
+			it.value().ackedOffset = qMax(it.value().ackedOffset, offset);
+
+		if (it.value().ackedOffset >= mServedArchives.value(it.value().hash).size)
+		{
+			mArchiveTransfers.erase(it);
+			releaseArchiveSource(_workerId, false);
+		}
+		else
+			sendArchiveChunks(_workerId, _clientInfo);
+	}
+	break;
+
+	case ComputeGrid::DPT_CREDIT:
+		if (args.isEmpty())
+			break;
+
+		mWorkers.grantCredit(_workerId, args[0].toLongLong());
+		drainCreditQueue(_workerId);
+		break;
+
+	case ComputeGrid::DPT_WORKER_DATA:
+		args.insert(args.begin(), QString::number(_workerId));
+		writeToProcess(PC_WORKER_DATA, args);
+		break;
+
+	case ComputeGrid::DPT_WORKER_EXIT:
+		args.insert(args.begin(), QString::number(_workerId));
+		writeToProcess(PC_WORKER_EXIT, args);
+		break;
+
+	case ComputeGrid::DPT_WORKER_RAW_DATA:
+		writeToProcess(PC_WORKER_RAW_DATA, QStringList() << QString::number(_workerId), _packet.data());
+		break;
+
+	case ComputeGrid::DPT_COMPRESSED:
+	{
+		QElapsedTimer et;
+		et.start();
+
+		DataPacketType type;
+		QByteArray data;
+		if (ComputeGridGlobals::decompressPacketData(_packet.data(), type, data))
+		{
+			mWorkers.countCompression(_workerId, data.size(), _packet.dataPtr()->size(), et.nsecsElapsed());
+
+			NetworkPacket np(NPT_DATA);
+			np.setTypeId(type);
+			np.setData(data);
+			handleDataPacket(_clientInfo, _workerId, np);
+		}
+		else
+			emit log(QString("Malformed compressed packet from Grid-Worker: %1").arg(_clientInfo.toString()), LT_WARNING);
+	}
+	break;
+
+	case ComputeGrid::DPT_WORKER_DATA_BATCH:
+	{
+		QList<QPair<DataPacketType, QByteArray>> entries;
+		if (!ComputeGridGlobals::parseBatch(_packet.data(), entries))
+			emit log(QString("Malformed batch packet from Grid-Worker: %1").arg(_clientInfo.toString()), LT_WARNING);
+
+		for (QList<QPair<DataPacketType, QByteArray>>::iterator it = entries.begin(); it != entries.end(); ++it)
+		{
+			NetworkPacket np(NPT_DATA);
+			np.setTypeId((*it).first);
+			np.setData((*it).second);
+			handleDataPacket(_clientInfo, _workerId, np);
+		}
+	}
+	break;
+
+	case ComputeGrid::DPT_LOG:
+		emit log(QString("(%1)%2").arg(_clientInfo.toString()).arg(args[2]), (LogType)(args[1].toUInt()), (LogSource)(args[0].toUInt()));
+		break;
+
+	default:
+		emit log(QString("Unknown network packet from Grid-Worker: %1").arg(_clientInfo.toString()), LT_WARNING);
+		break;
+	}
+}
+
+void ManagerProcessHost::networkError(QAbstractSocket::SocketError _socketError)
+{
+	emit log(QString("Socket error: %1").arg((_socketError >= 0 && _socketError < LiteralSocketError.count()) ? LiteralSocketError[_socketError] : "Unknown Network Error"), LT_ERROR);
+
+	// to do: consider restart?
+}
+void ManagerProcessHost::keepAliveTimerTimeout()
+{
+	QMetaObject::invokeMethod(this, "keepAliveClients");
+}
+
+void ManagerProcessHost::batchTimerTimeout()
+{
+	flushBatches();
+}
+
+void ManagerProcessHost::speculationTimerTimeout()
+{
+	sendTasks(mScheduler.speculate());
+}
+
+void ManagerProcessHost::deltaBuildFinished()
+{
+	QFutureWatcher<DeltaBuild> * watcher = static_cast<QFutureWatcher<DeltaBuild> *>(sender());
+	DeltaBuild build = watcher->result();
+	watcher->deleteLater();
+
+	if (build.archiveHash != mWorkerProcessHash)
+	{
+		// the archive was replaced meanwhile, its waiting workers got the new offer
+		if (!build.deltaFile.isEmpty())
+			QFile::remove(build.deltaFile);
+		return;
+	}
+
+	if (!build.error.isEmpty())
+		emit log(build.error, LT_ERROR);
+
+	ArchiveDelta delta = build.delta;
+	if (!build.ok || (!build.deltaFile.isEmpty() && !serveArchive(delta.hash, build.deltaFile)))
+	{
+		if (!build.deltaFile.isEmpty())
+			QFile::remove(build.deltaFile);
+
+		delta = fullWorkerArchiveDelta();
+	}
+	else
+		mArchiveDeltas.insert(build.key, delta);
+
+	QList<quint32> waiting = mDeltaWaiting.take(build.key);
+	for (QList<quint32>::const_iterator it = waiting.constBegin(); it != waiting.constEnd(); ++it)
+	{
+		WorkerInfo wi;
+		if (mWorkers.find(*it, &wi))
+			sendWorkerArchiveDelta(wi.client, delta);
+	}
 }
 #pragma endregion
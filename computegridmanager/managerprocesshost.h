@@ -3,13 +3,25 @@
 #include <QObject>
 #include <QProcess>
 #include <QMutex>
-#include <QFuture>
 #include <QString> 
 #include <QStringList>
 #include <QByteArray>
 #include <QTimer>
+#include <QHash>
+#include <QQueue>
+#include <QSet>
+#include <QFile>
+#include <QVector>
+#include <QSharedPointer>
+#include <QElapsedTimer>
+#include <QFutureWatcher>
 #include "computegridcommons.hpp"
+#include "processtransport.hpp"
+#include "failuredetector.hpp"
+#include "processinstallation.hpp"
 #include "networkserver.h"
+#include "workerregistry.h"
+#include "taskscheduler.h"
 
 using namespace Networking;
 
@@ -17,13 +29,77 @@ class ManagerProcessHost : public QObject
 {
 	Q_OBJECT
 
+	struct ArchiveTransfer
+	{
+		QString hash;
+		qint64 nextOffset;
+		qint64 ackedOffset;
+	};
+
+	struct ServedArchive
+	{
+		QString file;
+		qint64 size;
+		QSharedPointer<QFile> mapping; // kept open while served, unmapped with the last copy
+		const uchar * data; // null if it couldn't be mapped, chunks are read instead
+		QVector<QString> chunkMd5; // by chunk index, filled as chunks go out
+	};
+
+	struct ArchiveSeeder
+	{
+		QString address;
+		quint16 port;
+		int uploads;
+	};
+
+	struct ArchiveDelta
+	{
+		QString hash; // empty when nothing has to be added
+		int changedFiles;
+		QStringList removedFiles;
+	};
+
+	struct DeltaBuild
+	{
+		QString key; // sha256 of the sorted worker manifest
+		QStringList manifest;
+		QString archiveHash;
+		QString archiveFile;
+		qint64 archiveSize;
+		QHash<QString, QString> archiveManifest;
+		QString deltaPath;
+		ArchiveDelta delta;
+		QString deltaFile; // the built delta, served once the build is back on the host's thread
+		QString error;
+		bool ok;
+	};
+
+	struct PendingBatch
+	{
+		QByteArray data;
+		int count;
+		ComputeGrid::DataPacketType firstType;
+		QByteArray firstData;
+	};
+
 public:
 	ManagerProcessHost(int _keepAliveIntervalMs = NetworkingGlobals::DefaultTimeOut, QObject * _parent = nullptr);
 	~ManagerProcessHost();
 
 	bool startProcess(quint16 _port, int _maxClients = 0);
 	bool stopProcess();
-	void writeToProcess(QString _cmd);
+	void writeToProcess(ComputeGrid::ProcessCommand _pc, QStringList _args = QStringList(), const QByteArray & _data = QByteArray());
+	void setBinaryFraming(bool _enabled);
+	void setSharedMemoryTransport(bool _enabled);
+	void setBatching(int _maxBytes, int _lingerMs);
+	void setCompression(ComputeGrid::CompressionCodec _codec, int _thresholdBytes);
+	void setTaskRetryLimit(int _retryLimit);
+	void setSpeculation(double _budget, double _slowdown);
+	void setWorkStealing(int _depth);
+	void setFlowControl(qint64 _maxQueuedBytes);
+	void setLatencyAwareScheduling(int _bulkTaskBytes);
+	void setFailureDetection(int _heartbeatIntervalMs, double _phiThreshold);
+	void setSwarmDistribution(int _fanout);
 
 	bool loadProcessArchive(QString _archiveFile, bool _isManagerProcess = true);
 	bool attachWorkerArchive();
@@ -32,33 +108,104 @@ private:
 	bool startNetworkServer(quint16 _port, int _maxClients = 0);
 	bool stopNetworkServer();
 	bool sendPacket(NetworkPacket & _np, NetworkClientInfo & _nci);
+	bool sendToWorker(quint32 _workerId, NetworkPacket & _np);
+	bool sendToWorkerNow(quint32 _workerId, NetworkPacket & _np);
+	qint64 transmit(const WorkerInfo & _info, NetworkPacket & _np);
+	void drainCreditQueue(quint32 _workerId);
+	void updateFlowControl(quint32 _workerId);
+	bool flushBatch(quint32 _workerId);
+	void flushBatches();
+	void handleDataPacket(NetworkClientInfo & _clientInfo, quint32 _workerId, NetworkPacket & _packet);
+	void logWorkerStatistics(const WorkerInfo & _info);
+	void releaseWorker(quint32 _workerId);
+	void suspectWorker(quint32 _workerId, double _phi);
+	void rejoinWorker(quint32 _workerId);
+	void offerWorkerArchive(NetworkClientInfo & _clientInfo);
+	void startArchiveTransfer(quint32 _workerId, NetworkClientInfo & _clientInfo, const QString & _hash, qint64 _offset);
+	void sendArchiveChunks(quint32 _workerId, NetworkClientInfo & _clientInfo);
+	bool serveArchive(const QString & _hash, const QString & _file);
+	bool assignArchiveSource(quint32 _workerId, qint64 _offset);
+	void releaseArchiveSource(quint32 _workerId, bool _sourceFailed);
+	void assignWaitingDownloads();
+	static DeltaBuild buildWorkerArchiveDelta(DeltaBuild _build);
+	void requestWorkerArchiveDelta(quint32 _workerId, NetworkClientInfo & _clientInfo, const QStringList & _manifest);
+	void sendWorkerArchiveDelta(NetworkClientInfo & _clientInfo, const ArchiveDelta & _delta);
+	ArchiveDelta fullWorkerArchiveDelta();
+	QString workerDeltaPath();
+	void dispatchTasks();
+	void sendTasks(const QList<QPair<quint32, Task>> & _assignments);
+	void grantSteal(quint32 _thiefId, const QList<Task> & _tasks);
 	bool isNetworkListening();
 	QList<NetworkClientInfo> networkClients();
 	QString lastNetworkError();
 
-	void readProcessAsync();
-	Q_INVOKABLE void handleProcessCommand(QString _command);
+	void handleProcessCommand(ComputeGrid::ProcessMessage & _message);
 
 	Q_INVOKABLE void keepAliveClients();
-	bool findWorkerClient(const QString & _worker, NetworkClientInfo * _nci);
 
 	QProcess * mProcess;
-	QFuture<void> mProcessReadFuture;
+	QByteArray mProcessReadBuffer;
+	ComputeGrid::ProcessTransport * mProcessTransport;
+	bool mBinaryFraming; // manager.exe understands ProcessArgBinaryFraming
+	bool mUseSharedMemory;
 	NetworkServer * mNetServer;
+	WorkerRegistry mWorkers;
+	TaskScheduler mScheduler;
+	QHash<quint32, QQueue<quint32>> mPendingSteals; // victim -> thieves waiting for its revoke answer
 	QTimer * mKeepAliveTimer;
 	int mKeepAliveIntervalMs;
-	QByteArray mWorkerProcessData;
+	double mFailureThreshold;
+	QHash<quint32, ComputeGrid::PhiAccrualDetector> mDetectors; // from DPT_GRID_WORKER_READY on
+	QHash<quint32, qint64> mLastSentMs;
+	QHash<quint32, qint64> mLastProbeMs;
+	QSet<quint32> mSuspectedWorkers;
+	QHash<quint32, QStringList> mStaleTasks; // in flight on a suspected worker, reassigned and cancelled if it comes back
+	QElapsedTimer mClock; // monotonic, for the failure detectors and keep-alives
+	ComputeGrid::ProcessFraming mProcessFraming;
+	QString mWorkerProcessFile;
+	qint64 mWorkerProcessSize;
+	QString mWorkerProcessHash;
+	QHash<QString, QString> mWorkerProcessManifest; // path -> manifest entry
+	QHash<QString, ServedArchive> mServedArchives; // sha256 -> the worker archive and the deltas built from it
+	QHash<QString, ArchiveDelta> mArchiveDeltas; // sha256 of a worker manifest -> its delta
+	QHash<QString, QList<quint32>> mDeltaWaiting; // sha256 of a worker manifest -> workers waiting for its build
+	QHash<quint32, ArchiveTransfer> mArchiveTransfers;
+	int mSwarmFanout; // concurrent uploads per archive source, the manager included; 0 sends every archive from the manager
+	QHash<quint32, ArchiveSeeder> mArchiveSeeders; // workers serving the current archive to their peers
+	QHash<quint32, quint32> mArchiveSources; // downloading worker -> its seeder, 0 for the manager
+	QList<QPair<quint32, qint64>> mSwarmWaiting; // workers waiting for a free source, with their resume offset
+	QHash<quint32, PendingBatch> mPendingBatches;
+	QSet<quint32> mBatchingWorkers; // announced batch support in DPT_GRID_WORKER_READY
+	QTimer * mBatchTimer;
+	QTimer * mSpeculationTimer;
+	int mBatchMaxBytes;
+	int mBatchLingerMs;
+	quint64 mBatchedMessages;
+	quint64 mBatchPackets;
+	ComputeGrid::CompressionCodec mCompressionCodec;
+	int mCompressionThreshold;
+	QHash<quint32, QQueue<NetworkPacket>> mCreditQueues; // packets held back until the worker grants credit
+	qint64 mCreditQueuedBytes;
+	qint64 mFlowControlMaxBytes;
+	QSet<quint32> mPausedWorkers;
+	bool mGridPaused;
 	QMutex mProcessMutex;
 	QMutex mNetworkMutex;
 
+	static const int SpeculationIntervalMs = 500;
+	static const int TreeCacheSize = 4; // extracted archives kept per process
+	static const int RttProbeIntervals = 10; // heartbeats skipped for busy workers still go out this often
+
 #pragma region Signals-Slots
 signals:
 	void workerInGrid(QString _worker, int _capacity);
 	void workerOutGrid(QString _worker);
+	void workerLatency(QString _worker, double _rttMs, double _jitterMs);
 	void log(QString _message, ComputeGrid::LogType _logType = ComputeGrid::LT_INFO, ComputeGrid::LogSource _logSource = ComputeGrid::LS_GM);
 	void statusMessage(QString _message);
 
 public slots:
+	void processReadyRead();
 	void processStarted();
 	void processFinished(int _exitCode, QProcess::ExitStatus _exitStatus);
 
@@ -69,6 +216,9 @@ public slots:
 	void networkError(QAbstractSocket::SocketError _socketError);
 
 	void keepAliveTimerTimeout();
+	void batchTimerTimeout();
+	void speculationTimerTimeout();
+	void deltaBuildFinished();
 #pragma endregion
 
 };
@@ -0,0 +1,502 @@
+#include "taskscheduler.h"
+#include <algorithm>
+
+TaskScheduler::TaskScheduler(int _retryLimit)
+	: mRetryLimit(_retryLimit),
+	mSpeculativeBudget(0),
+	mSpeculativeSlowdown(2),
+	mRequeuedCount(0),
+	mSpeculativeCount(0),
+	mSpeculativeWins(0),
+	mSpeculativeInFlight(0),
+	mStealDepth(0),
+	mBulkTaskBytes(0),
+	mStolenCount(0)
+{
+	mClock.start();
+}
+
+// A task is given to at most 1 + _retryLimit workers before it's reported failed; 0 never retries.
+void TaskScheduler::setRetryLimit(int _retryLimit)
+{
+	mRetryLimit = qMax(0, _retryLimit);
+}
+
+// _budget is the share of the grid's slots duplicates may take (0 disables speculation),
+// a task straggles once it runs _slowdown times longer than the median completed task.
+void TaskScheduler::setSpeculation(double _budget, double _slowdown)
+{
+	mSpeculativeBudget = qBound(0.0, _budget, 1.0);
+	mSpeculativeSlowdown = qMax(1.0, _slowdown);
+}
+
+// In work-stealing mode each worker is given up to _depth times its capacity and queues the surplus
+// locally; idle workers then steal from the most loaded one. 0 keeps every task on the manager's queue.
+void TaskScheduler::setWorkStealing(int _depth)
+{
+	mStealDepth = qMax(0, _depth);
+}
+
+bool TaskScheduler::isWorkStealing() const
+{
+	return mStealDepth > 0;
+}
+
+// _prefetch tasks are sent beyond the worker's capacity and wait on the worker for a free slot.
+// Tasks with at least _bulkBytes of args go to the farthest worker with a free slot, smaller ones
+// to the nearest. 0 ignores RTT and spreads tasks by free slots only.
+void TaskScheduler::setLatencyAware(int _bulkBytes)
+{
+	mBulkTaskBytes = qMax(0, _bulkBytes);
+}
+
+void TaskScheduler::setWorkerRtt(quint32 _workerId, double _rttMs)
+{
+	QHash<quint32, WorkerSlots>::iterator it = mWorkers.find(_workerId);
+	if (it != mWorkers.end())
+		it.value().rttMs = _rttMs;
+}
+
+// A worker registering again has restarted its processes: what it had in flight is requeued as if it had left,
+// and its RTT is measured anew. Returns the tasks out of retries.
+QList<Task> TaskScheduler::addWorker(quint32 _workerId, int _capacity, int _prefetch)
+{
+	QList<Task> failed = removeWorker(_workerId);
+
+	WorkerSlots & ws = mWorkers[_workerId];
+	ws.capacity = qMax(1, _capacity);
+	ws.prefetch = qMax(0, _prefetch);
+	ws.rttMs = -1;
+
+	return failed;
+}
+
+void TaskScheduler::setCapacity(quint32 _workerId, int _capacity)
+{
+	QHash<quint32, WorkerSlots>::iterator it = mWorkers.find(_workerId);
+	if (it != mWorkers.end())
+		it.value().capacity = qMax(1, _capacity);
+}
+
+// Puts the worker's in-flight tasks back at the head of the queue, returns the ones out of retries.
+// Tasks with a copy still running elsewhere are left to that copy.
+QList<Task> TaskScheduler::removeWorker(quint32 _workerId)
+{
+	QList<Task> failed;
+
+	QHash<quint32, WorkerSlots>::iterator it = mWorkers.find(_workerId);
+	if (it == mWorkers.end())
+		return failed;
+
+	for (QHash<QString, Task>::iterator tit = it.value().inFlight.begin(); tit != it.value().inFlight.end(); ++tit)
+	{
+		QList<quint32> & runners = mRunning[tit.key()];
+		runners.removeOne(_workerId);
+
+		if (!runners.isEmpty())
+		{
+			--mSpeculativeInFlight;
+			continue;
+		}
+
+		mRunning.remove(tit.key());
+
+		if (tit.value().attempts > mRetryLimit)
+			failed.append(tit.value());
+		else
+		{
+			mQueue.prepend(tit.value());
+			mQueuedIds.insert(tit.key());
+			++mRequeuedCount;
+		}
+	}
+
+	mWorkers.erase(it);
+
+	return failed;
+}
+
+void TaskScheduler::clear()
+{
+	mQueue.clear();
+	mQueuedIds.clear();
+	mWorkers.clear();
+	mRunning.clear();
+	mDurations.clear();
+	mRequeuedCount = 0;
+	mSpeculativeCount = 0;
+	mSpeculativeWins = 0;
+	mSpeculativeInFlight = 0;
+	mStolenCount = 0;
+}
+
+// False if a task with the same id is still queued or running; its in-flight entry would be overwritten.
+bool TaskScheduler::submit(const Task & _task)
+{
+	if (mQueuedIds.contains(_task.id) || mRunning.contains(_task.id))
+		return false;
+
+	mQueue.enqueue(_task);
+	mQueuedIds.insert(_task.id);
+
+	return true;
+}
+
+// True for the first result of a task; the workers still running other copies are put in _cancelled.
+bool TaskScheduler::complete(quint32 _workerId, const QString & _taskId, QList<quint32> * _cancelled)
+{
+	QHash<quint32, WorkerSlots>::iterator it = mWorkers.find(_workerId);
+	if (it == mWorkers.end())
+		return false;
+
+	QHash<QString, Task>::iterator tit = it.value().inFlight.find(_taskId);
+	if (tit == it.value().inFlight.end())
+		return false;
+
+	Task task = release(it.value(), _taskId);
+	if (task.startedMs >= 0)
+	{
+		mDurations.append(mClock.elapsed() - task.startedMs);
+		if (mDurations.count() > DurationSamples)
+			mDurations.removeFirst();
+	}
+
+	QList<quint32> runners = mRunning.take(_taskId);
+	if (runners.count() > 1)
+	{
+		if (runners.first() != _workerId)
+			++mSpeculativeWins;
+
+		for (QList<quint32>::iterator rit = runners.begin(); rit != runners.end(); ++rit)
+		{
+			if (*rit == _workerId)
+				continue;
+
+			release(mWorkers[*rit], _taskId);
+			--mSpeculativeInFlight;
+
+			if (_cancelled)
+				_cancelled->append(*rit);
+		}
+	}
+
+	return true;
+}
+
+// The worker lost _taskIds but stays in the grid; they are requeued like the tasks of a removed worker.
+// _lost counts the ids that were in flight on it, the others are ignored.
+QList<Task> TaskScheduler::fail(quint32 _workerId, const QStringList & _taskIds, int * _lost)
+{
+	QList<Task> failed;
+
+	if (_lost)
+		*_lost = 0;
+
+	QHash<quint32, WorkerSlots>::iterator it = mWorkers.find(_workerId);
+	if (it == mWorkers.end())
+		return failed;
+
+	for (QStringList::const_iterator tit = _taskIds.constBegin(); tit != _taskIds.constEnd(); ++tit)
+	{
+		if (!it.value().inFlight.contains(*tit))
+			continue;
+
+		Task task = release(it.value(), *tit);
+		if (_lost)
+			++*_lost;
+
+		QList<quint32> & runners = mRunning[*tit];
+		runners.removeOne(_workerId);
+
+		if (!runners.isEmpty())
+		{
+			--mSpeculativeInFlight;
+			continue;
+		}
+
+		mRunning.remove(*tit);
+
+		if (task.attempts > mRetryLimit)
+			failed.append(task);
+		else
+		{
+			mQueue.prepend(task);
+			mQueuedIds.insert(task.id);
+			++mRequeuedCount;
+		}
+	}
+
+	return failed;
+}
+
+QList<QPair<quint32, Task>> TaskScheduler::dispatch()
+{
+	QList<QPair<quint32, Task>> assignments;
+
+	while (!mQueue.isEmpty())
+	{
+		QHash<quint32, WorkerSlots>::iterator best = pickWorker(mQueue.head());
+		if (best == mWorkers.end())
+			break;
+
+		Task task = mQueue.dequeue();
+		mQueuedIds.remove(task.id);
+		++task.attempts;
+		place(best.value(), task);
+		mRunning[task.id].append(best.key());
+		assignments.append(qMakePair(best.key(), task));
+	}
+
+	return assignments;
+}
+
+// Copies late tasks onto idle slots, oldest first, within the speculative budget.
+QList<QPair<quint32, Task>> TaskScheduler::speculate()
+{
+	QList<QPair<quint32, Task>> assignments;
+
+	if (mSpeculativeBudget <= 0 || !mQueue.isEmpty() || mDurations.count() < SpeculationMinSamples)
+		return assignments;
+
+	int totalCapacity = 0;
+	for (QHash<quint32, WorkerSlots>::const_iterator it = mWorkers.constBegin(); it != mWorkers.constEnd(); ++it)
+		totalCapacity += it.value().capacity;
+
+	int budget = qMax(1, (int)(totalCapacity * mSpeculativeBudget)) - mSpeculativeInFlight;
+	if (budget <= 0)
+		return assignments;
+
+	qint64 now = mClock.elapsed();
+	qint64 lateMs = (qint64)(durationQuantile(0.5) * mSpeculativeSlowdown);
+
+	QList<QPair<qint64, Task>> stragglers;
+	for (QHash<quint32, WorkerSlots>::const_iterator it = mWorkers.constBegin(); it != mWorkers.constEnd(); ++it)
+	{
+		for (QHash<QString, Task>::const_iterator tit = it.value().inFlight.constBegin(); tit != it.value().inFlight.constEnd(); ++tit)
+		{
+			if (tit.value().startedMs >= 0 && now - tit.value().startedMs > lateMs && mRunning.value(tit.key()).count() == 1)
+				stragglers.append(qMakePair(tit.value().startedMs, tit.value()));
+		}
+	}
+
+	std::sort(stragglers.begin(), stragglers.end(), [](const QPair<qint64, Task> & _a, const QPair<qint64, Task> & _b) { return _a.first < _b.first; });
+
+	for (QList<QPair<qint64, Task>>::iterator it = stragglers.begin(); it != stragglers.end() && budget > 0; ++it)
+	{
+		QList<quint32> & runners = mRunning[(*it).second.id];
+
+		// a copy only helps on a worker that can start it right away
+		QHash<quint32, WorkerSlots>::iterator best = freestWorker(runners, true);
+		if (best == mWorkers.end())
+			break;
+
+		Task task = (*it).second;
+		place(best.value(), task);
+		runners.append(best.key());
+		assignments.append(qMakePair(best.key(), task));
+
+		++mSpeculativeInFlight;
+		++mSpeculativeCount;
+		--budget;
+	}
+
+	return assignments;
+}
+
+// The worker holding the most tasks beyond its capacity, 0 if none holds any.
+quint32 TaskScheduler::stealVictim(quint32 _thiefId, int * _surplus)
+{
+	quint32 victim = 0;
+	int most = 0;
+	for (QHash<quint32, WorkerSlots>::const_iterator it = mWorkers.constBegin(); it != mWorkers.constEnd(); ++it)
+	{
+		int surplus = it.value().inFlight.count() - it.value().capacity;
+		if (surplus > most && it.key() != _thiefId)
+		{
+			victim = it.key();
+			most = surplus;
+		}
+	}
+
+	if (_surplus)
+		*_surplus = most;
+
+	return victim;
+}
+
+// Moves the revoked tasks to the thief; if the thief is gone they go back to the head of the queue.
+QList<Task> TaskScheduler::steal(quint32 _victimId, quint32 _thiefId, const QStringList & _taskIds)
+{
+	QList<Task> stolen;
+
+	QHash<quint32, WorkerSlots>::iterator victim = mWorkers.find(_victimId);
+	QHash<quint32, WorkerSlots>::iterator thief = mWorkers.find(_thiefId);
+	if (victim == mWorkers.end())
+		return stolen;
+
+	for (QStringList::const_iterator it = _taskIds.constBegin(); it != _taskIds.constEnd(); ++it)
+	{
+		if (!victim.value().inFlight.contains(*it) || mRunning.value(*it).count() != 1)
+			continue;
+
+		Task task = release(victim.value(), *it);
+
+		if (thief == mWorkers.end())
+		{
+			mRunning.remove(task.id);
+			mQueue.prepend(task);
+			mQueuedIds.insert(task.id);
+			continue;
+		}
+
+		place(thief.value(), task);
+		mRunning[task.id] = QList<quint32>() << _thiefId;
+		stolen.append(task);
+		++mStolenCount;
+	}
+
+	return stolen;
+}
+
+int TaskScheduler::queuedCount() const
+{
+	return mQueue.count();
+}
+
+quint64 TaskScheduler::requeuedCount() const
+{
+	return mRequeuedCount;
+}
+
+quint64 TaskScheduler::speculativeCount() const
+{
+	return mSpeculativeCount;
+}
+
+quint64 TaskScheduler::speculativeWins() const
+{
+	return mSpeculativeWins;
+}
+
+quint64 TaskScheduler::stolenCount() const
+{
+	return mStolenCount;
+}
+
+int TaskScheduler::inFlightCount() const
+{
+	int count = 0;
+	for (QHash<quint32, WorkerSlots>::const_iterator it = mWorkers.constBegin(); it != mWorkers.constEnd(); ++it)
+		count += it.value().inFlight.count();
+
+	return count;
+}
+
+QStringList TaskScheduler::inFlightIds(quint32 _workerId) const
+{
+	QHash<quint32, WorkerSlots>::const_iterator it = mWorkers.constFind(_workerId);
+	return it != mWorkers.constEnd() ? it.value().inFlight.keys() : QStringList();
+}
+
+#pragma region Helper Methods
+// The worker with the most free slots, skipping _exclude; end() if every slot is taken.
+// _runningOnly ignores the prefetch window.
+QHash<quint32, TaskScheduler::WorkerSlots>::iterator TaskScheduler::freestWorker(const QList<quint32> & _exclude, bool _runningOnly)
+{
+	QHash<quint32, WorkerSlots>::iterator best = mWorkers.end();
+	int bestFree = 0;
+	for (QHash<quint32, WorkerSlots>::iterator it = mWorkers.begin(); it != mWorkers.end(); ++it)
+	{
+		int free = (_runningOnly ? it.value().capacity : slotLimit(it.value())) - it.value().inFlight.count();
+		if (free > bestFree && !_exclude.contains(it.key()))
+		{
+			best = it;
+			bestFree = free;
+		}
+	}
+
+	return best;
+}
+
+QHash<quint32, TaskScheduler::WorkerSlots>::iterator TaskScheduler::pickWorker(const Task & _task)
+{
+	if (mBulkTaskBytes <= 0)
+		return freestWorker(QList<quint32>());
+
+	// size of the DPT_TASK payload: the QDataStream'ed QStringList of id and args, UTF-16 with length prefixes
+	int bytes = 4 + 4 + _task.id.size() * 2;
+	for (QStringList::const_iterator it = _task.args.constBegin(); it != _task.args.constEnd(); ++it)
+		bytes += 4 + (*it).size() * 2;
+
+	bool bulk = bytes >= mBulkTaskBytes;
+
+	// workers without an RTT sample yet are only picked when no measured one has a free slot
+	QHash<quint32, WorkerSlots>::iterator best = mWorkers.end();
+	for (QHash<quint32, WorkerSlots>::iterator it = mWorkers.begin(); it != mWorkers.end(); ++it)
+	{
+		if (slotLimit(it.value()) - it.value().inFlight.count() <= 0)
+			continue;
+
+		if (best == mWorkers.end()
+			|| (best.value().rttMs < 0 && it.value().rttMs >= 0)
+			|| (it.value().rttMs >= 0 && (bulk ? it.value().rttMs > best.value().rttMs : it.value().rttMs < best.value().rttMs)))
+			best = it;
+	}
+
+	return best;
+}
+
+int TaskScheduler::slotLimit(const WorkerSlots & _slots) const
+{
+	return qMax(_slots.capacity + _slots.prefetch, isWorkStealing() ? _slots.capacity * mStealDepth : 0);
+}
+
+// Tasks beyond the worker's capacity wait in its local queue; their clock starts once a slot frees.
+void TaskScheduler::place(WorkerSlots & _slots, Task & _task)
+{
+	if (_slots.inFlight.count() < _slots.capacity)
+		_task.startedMs = mClock.elapsed();
+	else
+	{
+		_task.startedMs = -1;
+		_slots.prefetched.enqueue(_task.id);
+	}
+
+	_slots.inFlight.insert(_task.id, _task);
+}
+
+Task TaskScheduler::release(WorkerSlots & _slots, const QString & _taskId)
+{
+	Task task = _slots.inFlight.take(_taskId);
+
+	if (task.startedMs < 0)
+		_slots.prefetched.removeOne(_taskId);
+	else
+	{
+		// the worker starts its next queued task in the freed slot
+		while (!_slots.prefetched.isEmpty())
+		{
+			QHash<QString, Task>::iterator it = _slots.inFlight.find(_slots.prefetched.dequeue());
+			if (it != _slots.inFlight.end())
+			{
+				it.value().startedMs = mClock.elapsed();
+				break;
+			}
+		}
+	}
+
+	return task;
+}
+
+qint64 TaskScheduler::durationQuantile(double _q) const
+{
+	QList<qint64> samples = mDurations;
+	if (samples.isEmpty())
+		return 0;
+
+	QList<qint64>::iterator nth = samples.begin() + qMin(samples.count() - 1, (int)(samples.count() * _q));
+	std::nth_element(samples.begin(), nth, samples.end());
+
+	return *nth;
+}
+#pragma endregion
\ No newline at end of file
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <QElapsedTimer>
+#include <QHash>
+#include <QList>
+#include <QPair>
+#include <QQueue>
+#include <QSet>
+#include <QString>
+#include <QStringList>
+
+struct Task
+{
+	QString id;
+	QStringList args;
+	int attempts;
+	qint64 startedMs; // -1 while prefetched on the worker
+};
+
+class TaskScheduler
+{
+public:
+	TaskScheduler(int _retryLimit = 3);
+
+	void setRetryLimit(int _retryLimit);
+	void setSpeculation(double _budget, double _slowdown);
+	void setWorkStealing(int _depth);
+	void setLatencyAware(int _bulkBytes);
+	void setWorkerRtt(quint32 _workerId, double _rttMs);
+	bool isWorkStealing() const;
+
+	QList<Task> addWorker(quint32 _workerId, int _capacity, int _prefetch = 0);
+	void setCapacity(quint32 _workerId, int _capacity);
+	QList<Task> removeWorker(quint32 _workerId);
+	void clear();
+
+	bool submit(const Task & _task);
+	bool complete(quint32 _workerId, const QString & _taskId, QList<quint32> * _cancelled = nullptr);
+	QList<Task> fail(quint32 _workerId, const QStringList & _taskIds, int * _lost = nullptr);
+	QList<QPair<quint32, Task>> dispatch();
+	QList<QPair<quint32, Task>> speculate();
+	quint32 stealVictim(quint32 _thiefId, int * _surplus);
+	QList<Task> steal(quint32 _victimId, quint32 _thiefId, const QStringList & _taskIds);
+
+	int queuedCount() const;
+	int inFlightCount() const;
+	QStringList inFlightIds(quint32 _workerId) const;
+	quint64 requeuedCount() const;
+	quint64 speculativeCount() const;
+	quint64 speculativeWins() const;
+	quint64 stolenCount() const;
+
+private:
+	struct WorkerSlots
+	{
+		int capacity;
+		int prefetch;
+		double rttMs; // -1 until the first sample
+		QHash<QString, Task> inFlight;
+		QQueue<QString> prefetched; // in the order the worker will start them
+	};
+
+	QHash<quint32, WorkerSlots>::iterator freestWorker(const QList<quint32> & _exclude, bool _runningOnly = false);
+	QHash<quint32, WorkerSlots>::iterator pickWorker(const Task & _task);
+	void place(WorkerSlots & _slots, Task & _task);
+	Task release(WorkerSlots & _slots, const QString & _taskId);
+	int slotLimit(const WorkerSlots & _slots) const;
+	qint64 durationQuantile(double _q) const;
+
+	int mRetryLimit;
+	double mSpeculativeBudget;
+	double mSpeculativeSlowdown;
+	quint64 mRequeuedCount;
+	quint64 mSpeculativeCount;
+	quint64 mSpeculativeWins;
+	int mSpeculativeInFlight;
+	int mStealDepth;
+	int mBulkTaskBytes;
+	quint64 mStolenCount;
+	QElapsedTimer mClock;
+	QQueue<Task> mQueue;
+	QSet<QString> mQueuedIds;
+	QHash<quint32, WorkerSlots> mWorkers;
+	QHash<QString, QList<quint32>> mRunning; // taskId -> workers running a copy, the original first
+	QList<qint64> mDurations;
+
+#pragma region Fields
+	static const int DurationSamples = 512;
+	static const int SpeculationMinSamples = 5;
+#pragma endregion
+};
\ No newline at end of file
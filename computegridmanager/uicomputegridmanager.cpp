@@ -30,6 +30,7 @@ UIComputeGridManager::UIComputeGridManager(QWidget * _parent)
 
 	QObject::connect(&mProcessHost, SIGNAL(workerInGrid(QString, int)), this, SLOT(workerInGrid(QString, int)));
 	QObject::connect(&mProcessHost, SIGNAL(workerOutGrid(QString)), this, SLOT(workerOutGrid(QString)));
+	QObject::connect(&mProcessHost, SIGNAL(workerLatency(QString, double, double)), this, SLOT(workerLatency(QString, double, double)));
 	QObject::connect(&mProcessHost, SIGNAL(log(QString, ComputeGrid::LogType, ComputeGrid::LogSource)), this, SLOT(log(QString, ComputeGrid::LogType, ComputeGrid::LogSource)));
 	QObject::connect(&mProcessHost, SIGNAL(statusMessage(QString)), this, SLOT(statusMessage(QString)));
 
@@ -37,6 +38,18 @@ UIComputeGridManager::UIComputeGridManager(QWidget * _parent)
 	settings.beginGroup("/General");
 	ui.spinBoxNetworkPort->setValue(settings.value("/ServerPort", NetworkingGlobals::DefaultServerPort).toUInt());
 	ui.spinBoxWorkerLimit->setValue(settings.value("/WorkerLimit", 0).toUInt());
+	mProcessHost.setBinaryFraming(settings.value("/BinaryFraming", false).toBool());
+	mProcessHost.setSharedMemoryTransport(settings.value("/SharedMemoryTransport", false).toBool());
+	mProcessHost.setBatching(settings.value("/BatchMaxBytes", 0).toInt(), settings.value("/BatchLingerMs", 2).toInt());
+	int codec = ComputeGrid::LiteralCompressionCodec.indexOf(settings.value("/Compression", ComputeGrid::LiteralCompressionCodec[ComputeGrid::CC_NONE]).toString());
+	mProcessHost.setCompression(codec > 0 ? (ComputeGrid::CompressionCodec)codec : ComputeGrid::CC_NONE, settings.value("/CompressionThreshold", 4096).toInt());
+	mProcessHost.setTaskRetryLimit(settings.value("/TaskRetryLimit", 3).toInt());
+	mProcessHost.setFlowControl(settings.value("/FlowControlMaxBytes", 64 * 1024 * 1024).toLongLong());
+	mProcessHost.setFailureDetection(settings.value("/HeartbeatIntervalMs", 1000).toInt(), settings.value("/FailureThreshold", 8.0).toDouble());
+	mProcessHost.setSwarmDistribution(settings.value("/SwarmFanout", 4).toInt());
+	mProcessHost.setLatencyAwareScheduling(settings.value("/BulkTaskBytes", 0).toInt());
+	mProcessHost.setWorkStealing(settings.value("/WorkStealingDepth", 0).toInt());
+	mProcessHost.setSpeculation(settings.value("/SpeculativeBudget", 0).toDouble(), settings.value("/SpeculativeSlowdown", 2.0).toDouble());
 	settings.endGroup();
 
 	refreshWorkersList();
@@ -109,7 +122,12 @@ void UIComputeGridManager::refreshWorkersList()
 	for (QMap<QString, int>::iterator it = mWorkerCapacityMap.begin(); it != mWorkerCapacityMap.end(); ++it)
 	{
 		totalCap += it.value();
-		ui.listWidgetWorkers->addItem(QString("%1 (Cap.: %2)").arg(it.key()).arg(it.value()));
+
+		if (mWorkerLatencyMap.contains(it.key()))
+			ui.listWidgetWorkers->addItem(QString("%1 (Cap.: %2, RTT: %3 ms, Jitter: %4 ms)").arg(it.key()).arg(it.value())
+				.arg(mWorkerLatencyMap[it.key()].first, 0, 'f', 1).arg(mWorkerLatencyMap[it.key()].second, 0, 'f', 1));
+		else
+			ui.listWidgetWorkers->addItem(QString("%1 (Cap.: %2)").arg(it.key()).arg(it.value()));
 	}
 
 	ui.labelGridWorkersStatus->setText(QString("%1 workers with %2 parallel compute capacity.").arg(mWorkerCapacityMap.count()).arg(totalCap));
@@ -120,7 +138,7 @@ void UIComputeGridManager::on_pushButtonProcessorSetManager_clicked()
 {
 	ui.pushButtonProcessorSetManager->setEnabled(false);
 	
-	QFile fManagerExe(QStandardPaths::writableLocation(QStandardPaths::AppDataLocation) + "/manager/manager.exe");
+	QFile fManagerExe(ComputeGrid::ProcessInstallation(QStandardPaths::writableLocation(QStandardPaths::AppDataLocation), "manager").executable());
 	if (fManagerExe.exists() && QMessageBox::Yes == QMessageBox(QMessageBox::Warning, "Warning", "A manager installation found and it will be overwritten if you install new one!\n\nDo you want to use existing instead of installing a new one?", QMessageBox::Yes | QMessageBox::No).exec())
 	{
 		ui.pushButtonProcessorSetWorker->setEnabled(true);
@@ -182,6 +200,7 @@ void UIComputeGridManager::on_pushButtonProcessorStop_clicked()
 	if (mProcessHost.stopProcess())
 	{
 		mWorkerCapacityMap.clear();
+		mWorkerLatencyMap.clear();
 		refreshWorkersList();
 		ui.labelStatus->clear();
 
@@ -203,7 +222,7 @@ void UIComputeGridManager::on_pushButtonCommandPromptSend_clicked()
 		ui.lineEditCommandPrompt->clear();
 
 		appendLog(cmd, Qt::darkGreen);
-		mProcessHost.writeToProcess(ComputeGrid::ComputeGridGlobals::makeProcessCommand(ComputeGrid::PC_TERMINAL_COMMAND, cmd.split(' ')));
+		mProcessHost.writeToProcess(ComputeGrid::PC_TERMINAL_COMMAND, cmd.split(' '));
 	}
 }
 
@@ -222,9 +241,19 @@ void UIComputeGridManager::workerOutGrid(QString _worker)
 	if (mWorkerCapacityMap.contains(_worker))
 		mWorkerCapacityMap.remove(_worker);
 
+	mWorkerLatencyMap.remove(_worker);
+
 	refreshWorkersList();
 }
 
+void UIComputeGridManager::workerLatency(QString _worker, double _rttMs, double _jitterMs)
+{
+	mWorkerLatencyMap[_worker] = qMakePair(_rttMs, _jitterMs);
+
+	if (mWorkerCapacityMap.contains(_worker))
+		refreshWorkersList();
+}
+
 void UIComputeGridManager::log(QString _message, ComputeGrid::LogType _logType, ComputeGrid::LogSource _logSource)
 {
 	QColor c = Qt::black;
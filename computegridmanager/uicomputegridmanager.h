@@ -30,6 +30,7 @@ private:
 	QVector<QString> mSentCommands;
 	int mSentCommandsShowIndex;
 	QMap<QString, int> mWorkerCapacityMap;
+	QMap<QString, QPair<double, double>> mWorkerLatencyMap;
 
 #pragma region Signals-Slots
 public slots:
@@ -41,6 +42,7 @@ public slots:
 
 	void workerInGrid(QString _worker, int _capacity);
 	void workerOutGrid(QString _worker);
+	void workerLatency(QString _worker, double _rttMs, double _jitterMs);
 	void log(QString _message, ComputeGrid::LogType _logType, ComputeGrid::LogSource _logSource);
 	void statusMessage(QString _message);
 #pragma endregion
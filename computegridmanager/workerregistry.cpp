@@ -0,0 +1,263 @@
+#include "workerregistry.h"
+
+WorkerRegistry::WorkerRegistry()
+	: mNextId(1)
+{
+}
+
+quint32 WorkerRegistry::add(NetworkClientInfo _client)
+{
+	WorkerInfo wi;
+	wi.address = _client.toString();
+	wi.client = _client;
+	wi.capacity = 0;
+	wi.prefetch = 0;
+	wi.codec = ComputeGrid::CC_NONE;
+	wi.packetsSent = 0;
+	wi.packetsReceived = 0;
+	wi.bytesSent = 0;
+	wi.bytesReceived = 0;
+	wi.compressionRawBytes = 0;
+	wi.compressionPackedBytes = 0;
+	wi.compressionNs = 0;
+	wi.credit = 0;
+	wi.creditLimited = false;
+	wi.srttMs = -1;
+	wi.rttVarMs = 0;
+
+	mMutex.lock();
+
+	QHash<QString, quint32>::iterator it = mAddressIndex.find(wi.address);
+	if (it != mAddressIndex.end())
+		mWorkers.remove(it.value());
+
+	wi.id = mNextId++;
+	if (mNextId == 0)
+		mNextId = 1; // 0 is reserved for "no worker"
+
+	mWorkers.insert(wi.id, wi);
+	mAddressIndex.insert(wi.address, wi.id);
+
+	mMutex.unlock();
+
+	return wi.id;
+}
+
+bool WorkerRegistry::remove(quint32 _id, WorkerInfo * _info)
+{
+	bool res = false;
+
+	mMutex.lock();
+
+	QHash<quint32, WorkerInfo>::iterator it = mWorkers.find(_id);
+	res = it != mWorkers.end();
+	if (res)
+	{
+		if (_info)
+			*_info = it.value();
+
+		mAddressIndex.remove(it.value().address);
+		mWorkers.erase(it);
+	}
+
+	mMutex.unlock();
+
+	return res;
+}
+
+void WorkerRegistry::clear()
+{
+	mMutex.lock();
+
+	mWorkers.clear();
+	mAddressIndex.clear();
+
+	mMutex.unlock();
+}
+
+quint32 WorkerRegistry::idOf(const QString & _address)
+{
+	mMutex.lock();
+	quint32 id = mAddressIndex.value(_address, 0);
+	mMutex.unlock();
+
+	return id;
+}
+
+bool WorkerRegistry::find(quint32 _id, WorkerInfo * _info)
+{
+	bool res = false;
+
+	mMutex.lock();
+
+	QHash<quint32, WorkerInfo>::const_iterator it = mWorkers.constFind(_id);
+	res = it != mWorkers.constEnd();
+	if (res)
+	{
+		if (_info)
+			*_info = it.value();
+	}
+
+	mMutex.unlock();
+
+	return res;
+}
+
+QList<quint32> WorkerRegistry::ids()
+{
+	mMutex.lock();
+	QList<quint32> res = mWorkers.keys();
+	mMutex.unlock();
+
+	return res;
+}
+
+void WorkerRegistry::setCapacity(quint32 _id, int _capacity, int _prefetch)
+{
+	mMutex.lock();
+
+	QHash<quint32, WorkerInfo>::iterator it = mWorkers.find(_id);
+	if (it != mWorkers.end())
+	{
+		it.value().capacity = _capacity;
+		it.value().prefetch = _prefetch;
+	}
+
+	mMutex.unlock();
+}
+
+void WorkerRegistry::countSent(quint32 _id, int _bytes)
+{
+	mMutex.lock();
+
+	QHash<quint32, WorkerInfo>::iterator it = mWorkers.find(_id);
+	if (it != mWorkers.end())
+	{
+		++it.value().packetsSent;
+		it.value().bytesSent += _bytes;
+	}
+
+	mMutex.unlock();
+}
+
+// Resolves the connection and counts the packet under one lock; 0 if the address isn't registered.
+quint32 WorkerRegistry::countReceived(const QString & _address, int _bytes)
+{
+	quint32 id = 0;
+
+	mMutex.lock();
+
+	QHash<QString, quint32>::const_iterator ait = mAddressIndex.constFind(_address);
+	if (ait != mAddressIndex.constEnd())
+	{
+		QHash<quint32, WorkerInfo>::iterator it = mWorkers.find(ait.value());
+		if (it != mWorkers.end())
+		{
+			id = it.key();
+			++it.value().packetsReceived;
+			it.value().bytesReceived += _bytes;
+		}
+	}
+
+	mMutex.unlock();
+
+	return id;
+}
+
+void WorkerRegistry::setCodec(quint32 _id, ComputeGrid::CompressionCodec _codec)
+{
+	mMutex.lock();
+
+	QHash<quint32, WorkerInfo>::iterator it = mWorkers.find(_id);
+	if (it != mWorkers.end())
+		it.value().codec = _codec;
+
+	mMutex.unlock();
+}
+
+void WorkerRegistry::countCompression(quint32 _id, int _rawBytes, int _packedBytes, qint64 _ns)
+{
+	mMutex.lock();
+
+	QHash<quint32, WorkerInfo>::iterator it = mWorkers.find(_id);
+	if (it != mWorkers.end())
+	{
+		it.value().compressionRawBytes += _rawBytes;
+		it.value().compressionPackedBytes += _packedBytes;
+		it.value().compressionNs += _ns;
+	}
+
+	mMutex.unlock();
+}
+
+// The credit the worker starts with; 0 leaves it unlimited.
+void WorkerRegistry::setCreditWindow(quint32 _id, qint64 _bytes)
+{
+	mMutex.lock();
+
+	QHash<quint32, WorkerInfo>::iterator it = mWorkers.find(_id);
+	if (it != mWorkers.end())
+	{
+		it.value().credit = qMax<qint64>(0, _bytes);
+		it.value().creditLimited = _bytes > 0;
+	}
+
+	mMutex.unlock();
+}
+
+void WorkerRegistry::grantCredit(quint32 _id, qint64 _bytes)
+{
+	mMutex.lock();
+
+	QHash<quint32, WorkerInfo>::iterator it = mWorkers.find(_id);
+	if (it != mWorkers.end())
+	{
+		it.value().credit += _bytes;
+		it.value().creditLimited = true;
+	}
+
+	mMutex.unlock();
+}
+
+void WorkerRegistry::consumeCredit(quint32 _id, qint64 _bytes)
+{
+	mMutex.lock();
+
+	QHash<quint32, WorkerInfo>::iterator it = mWorkers.find(_id);
+	if (it != mWorkers.end() && it.value().creditLimited)
+		it.value().credit -= _bytes;
+
+	mMutex.unlock();
+}
+
+// Smooths RTT samples as in RFC 6298.
+bool WorkerRegistry::updateRtt(quint32 _id, double _sampleMs, double * _srttMs, double * _rttVarMs)
+{
+	bool res = false;
+
+	mMutex.lock();
+
+	QHash<quint32, WorkerInfo>::iterator it = mWorkers.find(_id);
+	res = it != mWorkers.end();
+	if (res)
+	{
+		WorkerInfo & wi = it.value();
+		if (wi.srttMs < 0)
+		{
+			wi.srttMs = _sampleMs;
+			wi.rttVarMs = _sampleMs / 2;
+		}
+		else
+		{
+			wi.rttVarMs = 0.75 * wi.rttVarMs + 0.25 * qAbs(wi.srttMs - _sampleMs);
+			wi.srttMs = 0.875 * wi.srttMs + 0.125 * _sampleMs;
+		}
+
+		*_srttMs = wi.srttMs;
+		*_rttVarMs = wi.rttVarMs;
+	}
+
+	mMutex.unlock();
+
+	return res;
+}
\ No newline at end of file
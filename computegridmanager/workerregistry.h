@@ -0,0 +1,61 @@
+#pragma once
+
+#include <QHash>
+#include <QList>
+#include <QMutex>
+#include <QString>
+#include "computegridcommons.hpp"
+#include "networkserver.h"
+
+using namespace Networking;
+
+struct WorkerInfo
+{
+	quint32 id;
+	QString address;
+	NetworkClientInfo client;
+	int capacity;
+	int prefetch;
+	ComputeGrid::CompressionCodec codec;
+	quint64 packetsSent;
+	quint64 packetsReceived;
+	quint64 bytesSent;
+	quint64 bytesReceived;
+	quint64 compressionRawBytes;
+	quint64 compressionPackedBytes;
+	qint64 compressionNs;
+	qint64 credit; // bytes, may go negative by the last packet sent
+	bool creditLimited; // false for workers without a credit window
+	double srttMs; // smoothed round-trip time, -1 until the first heartbeat echo
+	double rttVarMs;
+};
+
+class WorkerRegistry
+{
+public:
+	WorkerRegistry();
+
+	quint32 add(NetworkClientInfo _client);
+	bool remove(quint32 _id, WorkerInfo * _info = nullptr);
+	void clear();
+
+	quint32 idOf(const QString & _address);
+	bool find(quint32 _id, WorkerInfo * _info);
+	QList<quint32> ids();
+
+	void setCapacity(quint32 _id, int _capacity, int _prefetch = 0);
+	void countSent(quint32 _id, int _bytes);
+	quint32 countReceived(const QString & _address, int _bytes);
+	void setCodec(quint32 _id, ComputeGrid::CompressionCodec _codec);
+	void countCompression(quint32 _id, int _rawBytes, int _packedBytes, qint64 _ns);
+	void setCreditWindow(quint32 _id, qint64 _bytes);
+	void grantCredit(quint32 _id, qint64 _bytes);
+	void consumeCredit(quint32 _id, qint64 _bytes);
+	bool updateRtt(quint32 _id, double _sampleMs, double * _srttMs, double * _rttVarMs);
+
+private:
+	QHash<quint32, WorkerInfo> mWorkers;
+	QHash<QString, quint32> mAddressIndex;
+	quint32 mNextId;
+	QMutex mMutex;
+};
@@ -1,17 +1,26 @@
 #include "uicomputegridworker.h"
 #include <QtWidgets/QApplication>
 #include <QSharedMemory>
+#include <QRegularExpression>
 
 QSharedMemory sharedMemory;
 
+// Workers sharing a host are started with "-instance <name>", each gets its own config and data directory.
 int main(int argc, char *argv[])
 {
-	sharedMemory.setKey("computegridworker");
+	QApplication a(argc, argv);
+
+	QStringList args = a.arguments();
+	int i = args.indexOf("-instance");
+	QString instance = i > 0 ? args.value(i + 1) : QString();
+	if (!QRegularExpression("^[A-Za-z0-9_-]*$").match(instance).hasMatch())
+		return -1;
+
+	sharedMemory.setKey(instance.isEmpty() ? QString("computegridworker") : QString("computegridworker_%1").arg(instance));
 
 	if (sharedMemory.create(1))
 	{
-		QApplication a(argc, argv);
-		UIComputeGridWorker w;
+		UIComputeGridWorker w(instance);
 		//w.show();
 		return a.exec();
 	}
@@ -6,8 +6,9 @@
 #include <QTextCursor>
 #include <QTextBlock>
 #include <QDateTime>
+#include <QStandardPaths>
 
-UIComputeGridWorker::UIComputeGridWorker(QWidget * _parent)
+UIComputeGridWorker::UIComputeGridWorker(const QString & _instance, QWidget * _parent)
 	: QMainWindow(_parent),
 	mNetServerIP(NetworkingGlobals::DefaultServerIP),
 	mNetServerPort(NetworkingGlobals::DefaultServerPort),
@@ -40,13 +41,27 @@ UIComputeGridWorker::UIComputeGridWorker(QWidget * _parent)
 	QObject::connect(&mProcessHost, SIGNAL(log(QString, ComputeGrid::LogType, ComputeGrid::LogSource)), this, SLOT(log(QString, ComputeGrid::LogType, ComputeGrid::LogSource)));
 	QObject::connect(&mProcessHost, SIGNAL(statusMessage(QString)), this, SLOT(statusMessage(QString)));
 
+	if (!_instance.isEmpty())
+		mProcessHost.setDataDirectory(QStandardPaths::writableLocation(QStandardPaths::AppDataLocation) + "/" + _instance);
+
 #pragma region Read Settings
-	QSettings settings(QCoreApplication::applicationName() + "_config.ini", QSettings::IniFormat);
+	QSettings settings(QCoreApplication::applicationName() + (_instance.isEmpty() ? QString() : "_" + _instance) + "_config.ini", QSettings::IniFormat);
 	settings.beginGroup("General");
 	mNetServerIP = settings.value("ServerIP", NetworkingGlobals::DefaultServerIP).toString();
 	mNetServerPort = settings.value("ServerPort", NetworkingGlobals::DefaultServerPort).toUInt();
 	mConnectTimeOut = settings.value("ConnectTimeOut", NetworkingGlobals::DefaultTimeOut).toUInt();
 	mReconnectTimeOut = settings.value("ReconnectTimeOut", NetworkingGlobals::DefaultTimeOut).toUInt();
+	mProcessHost.setBinaryFraming(settings.value("BinaryFraming", false).toBool());
+	mProcessHost.setSharedMemoryTransport(settings.value("SharedMemoryTransport", false).toBool());
+	mProcessHost.setBatching(settings.value("BatchMaxBytes", 0).toInt(), settings.value("BatchLingerMs", 2).toInt());
+	mProcessHost.setFailureThreshold(settings.value("FailureThreshold", 8.0).toDouble());
+	mProcessHost.setCreditWindow(settings.value("CreditWindowBytes", 4 * 1024 * 1024).toLongLong());
+	mProcessHost.setPrefetchDepth(settings.value("PrefetchDepth", 2).toInt());
+	mProcessHost.setPeerPort(settings.value("PeerPort", 0).toUInt());
+	QString affinity = settings.value("ProcessAffinity", "none").toString();
+	int processCount = qMax(1, settings.value("ProcessCount", 1).toInt());
+	mProcessHost.setProcesses(processCount, affinity == "numa" ? WorkerProcessHost::AM_NUMA : affinity == "cores" ? WorkerProcessHost::AM_CORES : WorkerProcessHost::AM_NONE);
+	mProcessHost.setProcessPool(settings.value("ProcessPoolSize", 0).toInt(), settings.value("ProcessRecycleTasks", 0).toInt(), settings.value("ProcessRecycleMemoryMB", 0).toLongLong() * 1024 * 1024);
 	settings.endGroup();
 #pragma endregion
 
@@ -14,7 +14,7 @@ class UIComputeGridWorker : public QMainWindow
 	Q_OBJECT
 
 public:
-	UIComputeGridWorker(QWidget * _parent = Q_NULLPTR);
+	UIComputeGridWorker(const QString & _instance = QString(), QWidget * _parent = Q_NULLPTR);
 	~UIComputeGridWorker();
 
 protected:
@@ -0,0 +1,405 @@
+#include "workerprocess.h"
+#include <QCoreApplication>
+#include <QAtomicInt>
+#include <QDir>
+#include <QFile>
+#ifdef Q_OS_WIN
+#include <windows.h>
+#include <psapi.h>
+#endif
+
+using namespace ComputeGrid;
+
+static QAtomicInt ProcessSequence; // keeps the shared-memory keys of pooled processes apart
+
+WorkerProcess::WorkerProcess(const QString & _directory, const QString & _workingDirectory, bool _binaryFraming, bool _useSharedMemory, QObject * _parent)
+	: QObject(_parent),
+	mProcess(nullptr),
+	mTransport(nullptr),
+	mFraming(PF_TEXT),
+	mDirectory(_directory),
+	mWorkingDirectory(_workingDirectory),
+	mBinaryFraming(_binaryFraming),
+	mUseSharedMemory(_useSharedMemory),
+	mAffinityMask(0),
+	mTaskSlots(0),
+	mRunningTasks(0),
+	mTasksRun(0),
+	mClean(false)
+{
+}
+
+WorkerProcess::~WorkerProcess()
+{
+	stop();
+}
+
+// A process about to serve a session is waited for; warm ones for the pool start in the background.
+bool WorkerProcess::start(bool _waitForStarted)
+{
+	bool res = true;
+
+	stop();
+
+	// older worker.exe builds don't know the flags, they stay on the text protocol
+	QStringList args;
+	if (mBinaryFraming)
+		args << ComputeGridGlobals::ProcessArgBinaryFraming;
+
+	if (mBinaryFraming && mUseSharedMemory)
+	{
+		mTransport = new ProcessTransport(QString("computegridworker_%1_%2").arg(QCoreApplication::applicationPid()).arg(ProcessSequence.fetchAndAddRelaxed(1)), true);
+		if (mTransport->open())
+			args << ComputeGridGlobals::ProcessArgSharedMemory << mTransport->key();
+		else
+		{
+			emit log(QString("Shared-memory transport couldn't be created, using pipe only."), LT_WARNING);
+			delete mTransport;
+			mTransport = nullptr;
+		}
+	}
+
+	if (!QDir().mkpath(mWorkingDirectory))
+		emit log(QString("File system I/O error! Directory:'%1' couldn't modify.").arg(mWorkingDirectory), LT_WARNING);
+
+	mMutex.lock();
+	mProcess = new QProcess();
+	QObject::connect(mProcess, SIGNAL(started()), this, SLOT(processStarted()));
+	QObject::connect(mProcess, SIGNAL(finished(int, QProcess::ExitStatus)), this, SIGNAL(finished(int, QProcess::ExitStatus)));
+	QObject::connect(mProcess, SIGNAL(readyReadStandardOutput()), this, SLOT(processReadyRead()));
+	QObject::connect(mProcess, SIGNAL(bytesWritten(qint64)), this, SIGNAL(bytesWritten(qint64)));
+	mProcess->setWorkingDirectory(mWorkingDirectory + "/");
+	mReadBuffer.clear();
+	mFraming = PF_TEXT; // switched to binary once worker.exe answers with a frame
+	mRunningTasks = 0;
+	mTasksRun = 0;
+	mClean = true;
+	mProcess->start(mDirectory + "/worker.exe", args);
+	mMutex.unlock();
+
+	if (_waitForStarted)
+		res = mProcess->waitForStarted();
+
+	if (!res)
+		stop();
+
+	return res;
+}
+
+void WorkerProcess::stop()
+{
+	mMutex.lock();
+	if (mProcess)
+	{
+		QObject::disconnect(mProcess, nullptr, this, nullptr);
+
+		try
+		{
+			mProcess->kill();
+		}
+		catch (...)
+		{
+		}
+
+		mProcess->deleteLater(); // stop() may run from the process's own finished signal
+		mProcess = nullptr;
+	}
+
+	if (mTransport)
+	{
+		if (mTransport->ringMessages() > 0)
+			emit log(QString("Shared-memory transport: %1 messages (%2 KB) through the ring, %3 large messages through the pipe.").arg(mTransport->ringMessages()).arg(mTransport->ringBytes() / 1024).arg(mTransport->pipeMessages()));
+
+		delete mTransport;
+		mTransport = nullptr;
+	}
+	mMutex.unlock();
+}
+
+bool WorkerProcess::isRunning()
+{
+	bool res = false;
+
+	mMutex.lock();
+	res = mProcess && mProcess->state() != QProcess::NotRunning;
+	mMutex.unlock();
+
+	return res;
+}
+
+// False if the message had to be dropped.
+bool WorkerProcess::write(ProcessCommand _pc, const QStringList & _args, const QByteArray & _data)
+{
+	bool res = true;
+
+	mMutex.lock();
+
+	if (mProcess)
+	{
+		if (mTransport && mTransport->isOutboundActive())
+		{
+			QByteArray pipeOut;
+			mTransport->send(ComputeGridGlobals::makeProcessFrame(_pc, _args, _data), pipeOut);
+
+			if (!pipeOut.isEmpty())
+				mProcess->write(pipeOut);
+		}
+		else if (mFraming == PF_BINARY)
+			mProcess->write(ComputeGridGlobals::makeProcessFrame(_pc, _args, _data));
+		else if (_data.isEmpty())
+			mProcess->write(ComputeGridGlobals::makeProcessMessage(mFraming, _pc, _args));
+		else
+			res = false;
+	}
+
+	mMutex.unlock();
+
+	return res;
+}
+
+bool WorkerProcess::isBackedUp(qint64 _pendingBytes)
+{
+	bool res = false;
+
+	mMutex.lock();
+
+	if (mProcess)
+		res = (mTransport && mTransport->hasBacklog()) || mProcess->bytesToWrite() >= _pendingBytes;
+
+	mMutex.unlock();
+
+	return res;
+}
+
+// Called when the process is given to a session; a warm process is moved onto its cores right away.
+void WorkerProcess::beginSession(int _taskSlots, quint64 _affinityMask)
+{
+	mTaskSlots = _taskSlots;
+	mRunningTasks = 0;
+	mAffinityMask = _affinityMask;
+	mClean = false;
+
+	if (isRunning())
+		applyAffinity();
+}
+
+bool WorkerProcess::isClean() const
+{
+	return mClean;
+}
+
+void WorkerProcess::markClean()
+{
+	mClean = true;
+}
+
+QString WorkerProcess::directory() const
+{
+	return mDirectory;
+}
+
+qint64 WorkerProcess::processId()
+{
+	qint64 res = 0;
+
+	mMutex.lock();
+	if (mProcess)
+		res = mProcess->processId();
+	mMutex.unlock();
+
+	return res;
+}
+
+// Working set (resident set on Linux) in bytes, -1 where it can't be read; the memory limit of the pool
+// doesn't recycle anything there.
+qint64 WorkerProcess::memoryBytes()
+{
+	qint64 res = -1;
+
+#ifdef Q_OS_WIN
+	HANDLE handle = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, (DWORD)processId());
+	if (handle)
+	{
+		PROCESS_MEMORY_COUNTERS pmc;
+		if (GetProcessMemoryInfo(handle, &pmc, sizeof(pmc)))
+			res = (qint64)pmc.WorkingSetSize;
+
+		CloseHandle(handle);
+	}
+#elif defined(Q_OS_LINUX)
+	QFile f(QString("/proc/%1/status").arg(processId()));
+	if (f.open(QIODevice::ReadOnly))
+	{
+		QList<QByteArray> lines = f.readAll().split('\n');
+		for (QList<QByteArray>::const_iterator it = lines.constBegin(); it != lines.constEnd(); ++it)
+		{
+			if ((*it).startsWith("VmRSS:"))
+				res = (*it).mid(6).trimmed().split(' ').first().toLongLong() * 1024; // in kB
+		}
+
+		f.close();
+	}
+#endif
+
+	return res;
+}
+
+int WorkerProcess::taskSlots() const
+{
+	return mTaskSlots;
+}
+
+quint64 WorkerProcess::affinityMask() const
+{
+	return mAffinityMask;
+}
+
+int WorkerProcess::runningTasks() const
+{
+	return mRunningTasks;
+}
+
+int WorkerProcess::tasksRun() const
+{
+	return mTasksRun;
+}
+
+void WorkerProcess::taskStarted()
+{
+	++mRunningTasks;
+	++mTasksRun;
+}
+
+void WorkerProcess::taskFinished()
+{
+	if (mRunningTasks > 0)
+		--mRunningTasks;
+}
+
+// Splits the cores this process may use into _count sets, or hands out whole NUMA nodes round-robin when
+// _numaNodes is set. Only the first processor group (64 cores) is used. 0 masks where affinity isn't supported.
+QList<quint64> WorkerProcess::affinityMasks(int _count, bool _numaNodes)
+{
+	QList<quint64> res;
+
+#ifdef Q_OS_WIN
+	if (_numaNodes)
+	{
+		QList<quint64> nodes;
+		ULONG highestNode = 0;
+		if (GetNumaHighestNodeNumber(&highestNode))
+		{
+			for (ULONG node = 0; node <= highestNode; ++node)
+			{
+				ULONGLONG mask = 0;
+				if (GetNumaNodeProcessorMask((UCHAR)node, &mask) && mask)
+					nodes.append(mask);
+			}
+		}
+
+		for (int i = 0; i < _count && !nodes.isEmpty(); ++i)
+			res.append(nodes[i % nodes.count()]);
+	}
+
+	DWORD_PTR processMask = 0, systemMask = 0;
+	if (res.isEmpty() && GetProcessAffinityMask(GetCurrentProcess(), &processMask, &systemMask))
+	{
+		QList<int> cores;
+		for (int bit = 0; bit < 64; ++bit)
+		{
+			if ((quint64)processMask & (1ULL << bit))
+				cores.append(bit);
+		}
+
+		for (int i = 0; i < _count && !cores.isEmpty(); ++i)
+		{
+			quint64 mask = 0;
+			if (_count >= cores.count())
+				mask = 1ULL << cores[i % cores.count()];
+			else
+			{
+				for (int c = i * cores.count() / _count; c < (i + 1) * cores.count() / _count; ++c)
+					mask |= 1ULL << cores[c];
+			}
+
+			res.append(mask);
+		}
+	}
+#endif
+
+	while (res.count() < _count)
+		res.append(0);
+
+	return res;
+}
+
+void WorkerProcess::applyAffinity()
+{
+#ifdef Q_OS_WIN
+	bool res = false;
+
+	HANDLE handle = OpenProcess(PROCESS_SET_INFORMATION | PROCESS_QUERY_LIMITED_INFORMATION, FALSE, (DWORD)processId());
+	if (handle)
+	{
+		DWORD_PTR processMask = 0, systemMask = 0;
+		if (GetProcessAffinityMask(GetCurrentProcess(), &processMask, &systemMask))
+		{
+			DWORD_PTR mask = mAffinityMask ? (DWORD_PTR)mAffinityMask & processMask : processMask;
+			res = mask && SetProcessAffinityMask(handle, mask);
+		}
+
+		CloseHandle(handle);
+	}
+
+	if (!res)
+		emit log(QString("Worker process (pid %1) couldn't be pinned to cores 0x%2.").arg(processId()).arg(mAffinityMask, 0, 16), LT_WARNING);
+#endif
+}
+
+#pragma region Slots
+void WorkerProcess::processStarted()
+{
+	applyAffinity();
+	emit started();
+}
+
+void WorkerProcess::processReadyRead()
+{
+	QList<ProcessMessage> messages;
+	bool backlogMoved = false;
+
+	mMutex.lock();
+	if (mProcess)
+	{
+		mReadBuffer.append(mProcess->readAllStandardOutput());
+
+		if (mTransport)
+		{
+			QList<ProcessMessage> pipeMessages;
+			QByteArray pipeOut;
+			bool backlog = mTransport->hasBacklog();
+			ComputeGridGlobals::parseProcessMessages(mReadBuffer, pipeMessages);
+			mTransport->receive(pipeMessages, messages, pipeOut);
+			backlogMoved = backlog && !mTransport->hasBacklog();
+
+			if (!pipeOut.isEmpty())
+				mProcess->write(pipeOut);
+		}
+		else
+			ComputeGridGlobals::parseProcessMessages(mReadBuffer, messages);
+
+		for (QList<ProcessMessage>::iterator it = messages.begin(); it != messages.end(); ++it)
+		{
+			if ((*it).framing == PF_BINARY)
+				mFraming = PF_BINARY;
+		}
+	}
+	mMutex.unlock();
+
+	if (backlogMoved)
+		emit bytesWritten(0); // worker.exe caught up with the ring, the host may grant credit
+
+	for (QList<ProcessMessage>::iterator it = messages.begin(); it != messages.end(); ++it)
+		emit messageReceived(*it);
+}
+#pragma endregion
\ No newline at end of file
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <QObject>
+#include <QProcess>
+#include <QMutex>
+#include <QStringList>
+#include <QByteArray>
+#include "computegridcommons.hpp"
+#include "processtransport.hpp"
+
+// One worker.exe with its pipe, framing and optional shared-memory lane. The host keeps several of them:
+// the ones serving the grid session, each with its own task slots and cores, and warm ones waiting in the
+// pool for the next session.
+class WorkerProcess : public QObject
+{
+	Q_OBJECT
+
+public:
+	WorkerProcess(const QString & _directory, const QString & _workingDirectory, bool _binaryFraming, bool _useSharedMemory, QObject * _parent = nullptr);
+	~WorkerProcess();
+
+	bool start(bool _waitForStarted);
+	void stop();
+	bool isRunning();
+	bool write(ComputeGrid::ProcessCommand _pc, const QStringList & _args = QStringList(), const QByteArray & _data = QByteArray());
+	bool isBackedUp(qint64 _pendingBytes);
+
+	void beginSession(int _taskSlots, quint64 _affinityMask);
+	bool isClean() const;
+	void markClean();
+	QString directory() const;
+	qint64 processId();
+	qint64 memoryBytes();
+	int taskSlots() const;
+	quint64 affinityMask() const;
+	int runningTasks() const;
+	int tasksRun() const;
+	void taskStarted();
+	void taskFinished();
+
+	static QList<quint64> affinityMasks(int _count, bool _numaNodes);
+
+private:
+	void applyAffinity();
+
+private:
+	QProcess * mProcess;
+	QByteArray mReadBuffer;
+	ComputeGrid::ProcessTransport * mTransport;
+	ComputeGrid::ProcessFraming mFraming;
+	QString mDirectory;
+	QString mWorkingDirectory; // outside the tree, which has to stay as extracted
+	bool mBinaryFraming;
+	bool mUseSharedMemory;
+	quint64 mAffinityMask; // 0 for all cores the host may use
+	int mTaskSlots;
+	int mRunningTasks;
+	int mTasksRun;
+	bool mClean; // no session has run in it since it started or confirmed PC_SESSION_RESET
+	QMutex mMutex;
+
+#pragma region Signals-Slots
+signals:
+	void started();
+	void finished(int _exitCode, QProcess::ExitStatus _exitStatus);
+	void bytesWritten(qint64 _bytes);
+	void messageReceived(ComputeGrid::ProcessMessage _message);
+	void log(QString _message, ComputeGrid::LogType _logType = ComputeGrid::LT_INFO, ComputeGrid::LogSource _logSource = ComputeGrid::LS_GW);
+
+private slots:
+	void processStarted();
+	void processReadyRead();
+#pragma endregion
+
+};
\ No newline at end of file
@@ -1,28 +1,77 @@
 #include "workerprocesshost.h"
 #include <QDir>
+#include <QDirIterator>
 #include <QFile>
+#include <QCryptographicHash>
 #include <QThread>
-#include <QtConcurrent/qtconcurrentrun.h>
 #include <QStandardPaths>
-#include "JlCompress.h"
+#include "archiveextractor.hpp"
+#include "quacrc32.h"
 
 using namespace ComputeGrid;
 
 WorkerProcessHost::WorkerProcessHost(int _keepAliveIntervalMs, QObject * _parent)
 	: QObject(_parent),
-	mProcess(nullptr),
+	mProcessPoolSize(0),
+	mRecycleTasks(0),
+	mRecycleMemoryBytes(0),
+	mBinaryFraming(false),
+	mUseSharedMemory(false),
 	mNetClient(nullptr),
-	mKeepAliveIntervalMs(_keepAliveIntervalMs)
+	mKeepAliveIntervalMs(_keepAliveIntervalMs),
+	mManagerDetector(_keepAliveIntervalMs),
+	mFailureThreshold(8),
+	mHeartbeatIntervalMs(0),
+	mLastSentMs(0),
+	mRequestedArchiveSize(0),
+	mArchivePart(nullptr),
+	mArchiveResendOffset(-1),
+	mArchiveResumed(false),
+	mPeerSource(nullptr),
+	mPeerProbe(nullptr),
+	mPeerServer(nullptr),
+	mPeerPort(0),
+	mPendingBatchCount(0),
+	mBatchMaxBytes(0),
+	mBatchLingerMs(2),
+	mManagerBatching(false),
+	mCompressionCodec(CC_NONE),
+	mCompressionThreshold(0),
+	mTaskSlots(QThread::idealThreadCount()),
+	mPrefetchDepth(0),
+	mWorkStealing(false),
+	mStealRequested(false),
+	mStealBackoffMs(StealRetryMs),
+	mCreditWindow(0),
+	mCreditOwed(0)
 {
 	NetworkingGlobals::registerMetaTypes();
 
 	mKeepAliveTimer = new QTimer(this);
 	QObject::connect(mKeepAliveTimer, SIGNAL(timeout()), this, SLOT(keepAliveTimerTimeout()));
+
+	mBatchTimer = new QTimer(this);
+	mBatchTimer->setSingleShot(true);
+	QObject::connect(mBatchTimer, SIGNAL(timeout()), this, SLOT(batchTimerTimeout()));
+
+	mPeerStallTimer = new QTimer(this);
+	mPeerStallTimer->setSingleShot(true);
+	QObject::connect(mPeerStallTimer, SIGNAL(timeout()), this, SLOT(peerStallTimeout()));
+
+	mDataDirectory = QStandardPaths::writableLocation(QStandardPaths::AppDataLocation);
+
+	setProcesses(1, AM_NONE);
+
+	mClock.start();
 }
 
 WorkerProcessHost::~WorkerProcessHost()
 {
+	closeArchiveTransfer();
+	closeArchivePeer();
+	setPeerPort(0);
 	stopProcess();
+	clearProcessPool();
 	disconnectFromNetworkServer();
 }
 
@@ -67,105 +116,402 @@ bool WorkerProcessHost::disconnectFromNetworkServer()
 	return res;
 }
 
+// Every session process is a warm one of the current tree when there is one, otherwise it is started.
 bool WorkerProcessHost::startProcess()
 {
-	bool res = false;
+	bool res = true;
 
 	stopProcess();
 
-	mProcessMutex.lock();
-	mProcess = new QProcess();
-	QObject::connect(mProcess, SIGNAL(started()), this, SLOT(processStarted()));
-	QObject::connect(mProcess, SIGNAL(finished(int, QProcess::ExitStatus)), this, SLOT(processFinished(int, QProcess::ExitStatus)));
-	mProcess->setWorkingDirectory(QStandardPaths::writableLocation(QStandardPaths::AppDataLocation) + "/worker/");
-	mProcess->start(QStandardPaths::writableLocation(QStandardPaths::AppDataLocation) + "/worker/worker.exe", QStringList());
-	res = mProcess->waitForStarted();
-	mProcessMutex.unlock();
+	QString dir = installation().currentDir();
+	QList<WorkerProcess *> processes;
+
+	for (int i = 0; i < mProcessSlots.count() && res; ++i)
+	{
+		WorkerProcess * process = nullptr;
+
+		while (!mIdleProcesses.isEmpty() && !process)
+		{
+			process = mIdleProcesses.takeFirst();
+			if (process->directory() != dir || !process->isRunning() || !process->isClean())
+			{
+				if (!process->isClean() && process->isRunning())
+					emit log(QString("Worker process (pid %1) didn't confirm its session reset, it is replaced.").arg(process->processId()), LT_WARNING);
+
+				retireProcess(process);
+				process = nullptr;
+			}
+		}
+
+		if (process)
+		{
+			emit log(QString("Warm worker process (pid %1) took the session.").arg(process->processId()));
+			process->beginSession(mProcessSlots[i], mProcessAffinity[i]);
+		}
+		else
+		{
+			process = createProcess(dir);
+			process->beginSession(mProcessSlots[i], mProcessAffinity[i]);
+			res = process->start(true);
+		}
+
+		processes.append(process);
+	}
 
 	if (res)
-		mProcessReadFuture = QtConcurrent::run(this, &WorkerProcessHost::readProcessAsync);
+	{
+		mProcessMutex.lock();
+		mProcesses = processes;
+		mProcessMutex.unlock();
+
+		// a process lost in the previous session took its slots along
+		mTaskSlots = 0;
+		for (QList<int>::const_iterator it = mProcessSlots.constBegin(); it != mProcessSlots.constEnd(); ++it)
+			mTaskSlots += *it;
+
+		fillProcessPool();
+	}
 	else
-		stopProcess();
+	{
+		while (!processes.isEmpty())
+			retireProcess(processes.takeFirst());
+	}
 
 	return res;
 }
 
+// The processes go back to the pool, warm for the next session, unless they are due for recycling. They are told
+// to drop the session's state and only serve again once they confirm it.
 bool WorkerProcessHost::stopProcess()
 {
-	bool res = false;
-
-	if (mProcessReadFuture.isRunning())
-		mProcessReadFuture.cancel();
-
 	mProcessMutex.lock();
-	if (mProcess)
+	QList<WorkerProcess *> processes = mProcesses;
+	mProcesses.clear();
+	mProcessMutex.unlock();
+
+	for (QList<WorkerProcess *>::iterator it = processes.begin(); it != processes.end(); ++it)
 	{
-		try
+		if (isReusable(*it) && mIdleProcesses.count() < mProcessPoolSize)
 		{
-			mProcess->kill();
+			(*it)->write(PC_SESSION_RESET);
+			mIdleProcesses.append(*it);
 		}
-		catch (...)
+		else
+			retireProcess(*it);
+	}
+
+	return !processes.isEmpty();
+}
+
+void WorkerProcessHost::writeToProcess(ProcessCommand _pc, QStringList _args, const QByteArray & _data)
+{
+	bool dropped = false;
+
+	mProcessMutex.lock();
+
+	for (QList<WorkerProcess *>::iterator it = mProcesses.begin(); it != mProcesses.end(); ++it)
+		dropped = !(*it)->write(_pc, _args, _data) || dropped;
+
+	mProcessMutex.unlock();
+
+	if (dropped)
+		emit log(QString("Raw data (%1 bytes) dropped, process doesn't support binary framing.").arg(_data.size()), LT_WARNING);
+}
+
+// Starts processes in the background until _size of them are waiting, so a session doesn't wait for worker.exe
+// to load. Processes are recycled after _recycleTasks tasks or once their working set exceeds _recycleMemoryBytes.
+void WorkerProcessHost::setProcessPool(int _size, int _recycleTasks, qint64 _recycleMemoryBytes)
+{
+	mProcessPoolSize = qMax(0, _size);
+	mRecycleTasks = qMax(0, _recycleTasks);
+	mRecycleMemoryBytes = qMax((qint64)0, _recycleMemoryBytes);
+
+	while (mIdleProcesses.count() > mProcessPoolSize)
+		retireProcess(mIdleProcesses.takeLast());
+
+	fillProcessPool();
+}
+
+// _count processes serve each session, over the one manager connection. Each gets the task slots of its cores,
+// or an equal share of the host's threads when they aren't pinned.
+void WorkerProcessHost::setProcesses(int _count, AffinityMode _affinity)
+{
+	_count = qMax(1, _count);
+
+	mProcessAffinity = _affinity == AM_NONE ? QList<quint64>() : WorkerProcess::affinityMasks(_count, _affinity == AM_NUMA);
+	while (mProcessAffinity.count() < _count)
+		mProcessAffinity.append(0);
+
+	int threads = QThread::idealThreadCount();
+	mProcessSlots.clear();
+	mTaskSlots = 0;
+
+	for (int i = 0; i < _count; ++i)
+	{
+		quint64 mask = mProcessAffinity[i];
+		int slots = mask ? qMax(1, (int)qPopulationCount(mask) / mProcessAffinity.count(mask)) // processes sharing a node share its cores
+			: qMax(1, (i + 1) * threads / _count - i * threads / _count);
+
+		mProcessSlots.append(slots);
+		mTaskSlots += slots;
+	}
+}
+
+void WorkerProcessHost::fillProcessPool()
+{
+	ProcessInstallation install = installation();
+	if (!QFile::exists(install.executable()))
+		return;
+
+	while (mIdleProcesses.count() < mProcessPoolSize)
+	{
+		WorkerProcess * process = createProcess(install.currentDir());
+		if (!process->start(false))
 		{
+			retireProcess(process);
+			break;
 		}
 
-		delete mProcess;
-		mProcess = nullptr;
-		res = true;
+		mIdleProcesses.append(process);
 	}
-	mProcessMutex.unlock();
+}
 
-	return res;
+WorkerProcess * WorkerProcessHost::createProcess(const QString & _dir)
+{
+	WorkerProcess * process = new WorkerProcess(_dir, installation().scratchDir(), mBinaryFraming, mUseSharedMemory, this);
+	QObject::connect(process, SIGNAL(log(QString, ComputeGrid::LogType, ComputeGrid::LogSource)), this, SIGNAL(log(QString, ComputeGrid::LogType, ComputeGrid::LogSource)));
+	QObject::connect(process, SIGNAL(started()), this, SLOT(processStarted()));
+	QObject::connect(process, SIGNAL(finished(int, QProcess::ExitStatus)), this, SLOT(processFinished(int, QProcess::ExitStatus)));
+	QObject::connect(process, SIGNAL(messageReceived(ComputeGrid::ProcessMessage)), this, SLOT(processMessageReceived(ComputeGrid::ProcessMessage)));
+	QObject::connect(process, SIGNAL(bytesWritten(qint64)), this, SLOT(processBytesWritten(qint64)));
+
+	return process;
 }
 
-void WorkerProcessHost::writeToProcess(QString _cmd)
+void WorkerProcessHost::clearProcessPool()
 {
-	mProcessMutex.lock();
-	if (mProcess)
-		mProcess->write((_cmd.simplified() + ComputeGridGlobals::ProcessCommandSuffix).toLocal8Bit());
-	mProcessMutex.unlock();
+	while (!mIdleProcesses.isEmpty())
+		retireProcess(mIdleProcesses.takeFirst());
+}
+
+// Only a process that is let go is told to exit; pooled ones get PC_SESSION_RESET alone.
+void WorkerProcessHost::retireProcess(WorkerProcess * _process)
+{
+	if (_process->isRunning())
+		_process->write(PC_WORKER_EXIT, QStringList() << QString::number(-1));
+
+	_process->stop();
+	QObject::disconnect(_process, nullptr, this, nullptr);
+	_process->deleteLater();
+}
+
+bool WorkerProcessHost::isReusable(WorkerProcess * _process)
+{
+	if (!_process->isRunning() || _process->directory() != installation().currentDir())
+		return false;
+
+	if (mRecycleTasks > 0 && _process->tasksRun() >= mRecycleTasks)
+	{
+		emit log(QString("Worker process (pid %1) recycled after %2 tasks.").arg(_process->processId()).arg(_process->tasksRun()));
+		return false;
+	}
+
+	qint64 memory = mRecycleMemoryBytes > 0 ? _process->memoryBytes() : -1;
+	if (memory > mRecycleMemoryBytes)
+	{
+		emit log(QString("Worker process (pid %1) recycled at %2 MB.").arg(_process->processId()).arg(memory / (1024 * 1024)));
+		return false;
+	}
+
+	return true;
+}
+
+void WorkerProcessHost::setBinaryFraming(bool _enabled)
+{
+	mBinaryFraming = _enabled;
+}
+
+void WorkerProcessHost::setSharedMemoryTransport(bool _enabled)
+{
+	mUseSharedMemory = _enabled;
+}
+
+void WorkerProcessHost::setBatching(int _maxBytes, int _lingerMs)
+{
+	flushBatch();
+
+	mBatchMaxBytes = _maxBytes;
+	mBatchLingerMs = qMax(0, _lingerMs);
+}
+
+// Tasks the manager may send beyond the ideal thread count, queued here so a freed slot never waits for the network.
+void WorkerProcessHost::setPrefetchDepth(int _depth)
+{
+	mPrefetchDepth = qMax(0, _depth);
+}
+
+// The manager may have at most _bytes in flight towards this worker; 0 leaves it unlimited.
+void WorkerProcessHost::setCreditWindow(qint64 _bytes)
+{
+	mCreditWindow = qMax<qint64>(0, _bytes);
+}
+
+// The connection is dropped once the manager's silence reaches _phiThreshold.
+void WorkerProcessHost::setFailureThreshold(double _phiThreshold)
+{
+	mFailureThreshold = qMax(1.0, _phiThreshold);
+}
+
+// 0 keeps this worker from serving its cached archives to other workers.
+void WorkerProcessHost::setPeerPort(quint16 _port)
+{
+	if (mPeerServer)
+	{
+		if (mPeerServer->isListening())
+			mPeerServer->stopServer();
+
+		delete mPeerServer;
+		mPeerServer = nullptr;
+	}
+
+	mPeerUploads.clear();
+	mPeerPort = _port;
+
+	if (mPeerPort == 0)
+		return;
+
+	mPeerServer = new NetworkServer(mPeerPort);
+	QObject::connect(mPeerServer, SIGNAL(clientDisconnected(NetworkClientInfo)), this, SLOT(peerClientDisconnected(NetworkClientInfo)));
+	QObject::connect(mPeerServer, SIGNAL(packetReceived(NetworkClientInfo, NetworkPacket)), this, SLOT(peerPacketReceived(NetworkClientInfo, NetworkPacket)));
+
+	if (!mPeerServer->startServer())
+	{
+		emit log(QString("Peer port %1 couldn't listen, cached archives won't be shared with other workers.").arg(mPeerPort), LT_WARNING);
+
+		delete mPeerServer;
+		mPeerServer = nullptr;
+		mPeerPort = 0;
+	}
+}
+
+// Cache, parts and extracted trees live here; workers sharing a host need one each.
+void WorkerProcessHost::setDataDirectory(const QString & _dir)
+{
+	mDataDirectory = _dir;
 }
 
-bool WorkerProcessHost::loadProcessArchive()
+// Every archive is extracted once, into the tree named by its hash. With _removedFiles the archive is a delta:
+// the tree in use is copied to the staging name of _hash and the delta is extracted over it; an empty delta only removes.
+// With _archiveData the archive is extracted from memory and _archiveFile only names it.
+bool WorkerProcessHost::loadProcessArchive(QString _archiveFile, QString _hash, const QStringList * _removedFiles, const QByteArray * _archiveData)
 {
 	QString msg;
 	bool res = false;
+	bool isDelta = _removedFiles != nullptr;
+
+	ProcessInstallation install = installation();
+	if (_hash.isEmpty())
+		_hash = _archiveData ? QString(QCryptographicHash::hash(*_archiveData, QCryptographicHash::Sha256).toHex()) : ProcessInstallation::hashFile(_archiveFile);
+
+	if (_hash != install.currentHash())
+	{
+		// processes of the old tree would keep it locked
+		stopProcess();
+		clearProcessPool();
+	}
 
-	QDir dir(QStandardPaths::writableLocation(QStandardPaths::AppDataLocation) + "/worker");
-	if (
+	QDir dir(install.stagingDir(_hash));
+	if (_hash.isEmpty())
+		msg = QString("File system I/O error! Archive:'%1' couldn't find.").arg(_archiveFile);
+	else if (!isDelta && install.hasTree(_hash))
+	{
+		emit log(QString("Worker archive %1 is already extracted.").arg(_hash.left(12)));
+		res = true;
+	}
+	else if (
 		(dir.exists() && !dir.removeRecursively())
+		|| (isDelta && !install.stageCurrent(_hash))
 		|| (!dir.exists() && !dir.mkpath(dir.absolutePath())))
 		msg = QString("File system I/O error! Directory:'%1' couldn't modify.").arg(dir.absolutePath());
-	else if (!QFile::exists(QStandardPaths::writableLocation(QStandardPaths::AppDataLocation) + "/worker.zip"))
-		msg = QString("File system I/O error! Archive:'%1' couldn't find.").arg(QStandardPaths::writableLocation(QStandardPaths::AppDataLocation) + "worker.zip");
+	else if (!(isDelta && _archiveFile.isEmpty()) && !_archiveData && !QFile::exists(_archiveFile))
+		msg = QString("File system I/O error! Archive:'%1' couldn't find.").arg(_archiveFile);
 	else
 	{
-		QStringList files = JlCompress::extractDir(QStandardPaths::writableLocation(QStandardPaths::AppDataLocation) + "/worker.zip", dir.absolutePath());
-		if (files.isEmpty() || !files.contains(dir.absolutePath() + "/worker.exe"))
-			msg = QString("Archive error! '%1' is invalid, doesn't contain executable: %2").arg("worker.zip").arg("worker.exe");
-		else
-		{
-			QProcess p;
-			p.start(dir.absolutePath() + "/worker.exe", QStringList() << "-test");
+		QStringList files;
+		if (_archiveData)
+			files = ArchiveExtractor::extract(*_archiveData, dir.absolutePath());
+		else if (!_archiveFile.isEmpty())
+			files = ArchiveExtractor::extract(_archiveFile, dir.absolutePath());
 
-			if (!p.waitForFinished(10000))
-			{
-				p.kill();
-				msg = QString("Executable is timed out.");
-			}
-			else if (p.exitCode() < 0)
-				msg = QString("Executable exited with code: %1.").arg(p.exitCode());
-			else
+		if (isDelta)
+		{
+			QString root = QDir::cleanPath(dir.absolutePath()) + "/";
+			for (QStringList::const_iterator it = _removedFiles->constBegin(); it != _removedFiles->constEnd(); ++it)
 			{
-				msg = QString("%1-Process has been successfully set.").arg("Worker");
-				res = true;
+				// never outside the worker directory
+				QString file = QDir::cleanPath(root + *it);
+				if (QDir::isRelativePath(*it) && file.startsWith(root))
+					QFile::remove(file);
 			}
 		}
+
+		if (isDelta ? !QFile::exists(dir.absolutePath() + "/worker.exe") || (!_archiveFile.isEmpty() && files.isEmpty())
+			: files.isEmpty() || !files.contains(dir.absolutePath() + "/worker.exe"))
+			msg = QString("Archive error! '%1' is invalid, doesn't contain executable: %2").arg(QFileInfo(_archiveFile).fileName()).arg("worker.exe");
+		else if (!install.commitTree(_hash))
+			msg = QString("File system I/O error! Directory:'%1' couldn't modify.").arg(install.treeDir(_hash));
+		else
+			res = true;
+	}
+
+	if (res && !install.isTested(_hash))
+	{
+		res = false;
+
+		QProcess p;
+		p.start(install.treeDir(_hash) + "/worker.exe", QStringList() << "-test");
+
+		if (!p.waitForFinished(10000))
+		{
+			p.kill();
+			msg = QString("Executable is timed out.");
+		}
+		else if (p.exitCode() < 0)
+			msg = QString("Executable exited with code: %1.").arg(p.exitCode());
+		else
+		{
+			install.markTested(_hash);
+			res = true;
+		}
+	}
+
+	if (res)
+	{
+		if (install.setCurrent(_hash))
+		{
+			// scanned once here, every later offer answers with the stored one
+			if (!install.hasManifest(_hash))
+				install.setManifest(_hash, treeManifest(install.treeDir(_hash)));
+
+			install.prune(TreeCacheSize);
+			msg = QString("%1-Process has been successfully set.").arg("Worker");
+		}
+		else
+		{
+			msg = QString("File system I/O error! Worker tree couldn't switch to %1.").arg(_hash.left(12));
+			res = false;
+		}
 	}
 
 	emit log(msg, res ? LT_INFO : LT_ERROR);
 	return res;
 }
 
+ProcessInstallation WorkerProcessHost::installation()
+{
+	return ProcessInstallation(mDataDirectory, "worker");
+}
+
 bool WorkerProcessHost::sendPacket(NetworkPacket & _np)
 {
 	bool res = false;
@@ -177,9 +523,76 @@ bool WorkerProcessHost::sendPacket(NetworkPacket & _np)
 
 	mNetworkMutex.unlock();
 
+	if (res)
+		mLastSentMs = mClock.elapsed();
+
 	return res;
 }
 
+bool WorkerProcessHost::sendDataPacket(NetworkPacket & _np)
+{
+	// older managers can't unpack batches
+	if (mBatchMaxBytes <= 0 || !mManagerBatching)
+		return sendCompressiblePacket(_np);
+
+	if (mPendingBatchCount == 0)
+	{
+		mPendingBatchFirstType = (DataPacketType)_np.typeId();
+		mPendingBatchFirstData = *_np.dataPtr();
+	}
+
+	ComputeGridGlobals::appendBatchEntry(mPendingBatch, (DataPacketType)_np.typeId(), *_np.dataPtr());
+	++mPendingBatchCount;
+
+	if (mPendingBatch.size() >= mBatchMaxBytes)
+		return flushBatch();
+
+	if (!mBatchTimer->isActive())
+		mBatchTimer->start(mBatchLingerMs);
+
+	return true;
+}
+
+bool WorkerProcessHost::flushBatch()
+{
+	if (mPendingBatchCount == 0)
+		return true;
+
+	NetworkPacket np(NPT_DATA);
+	if (mPendingBatchCount == 1)
+	{
+		np.setTypeId(mPendingBatchFirstType);
+		np.setData(mPendingBatchFirstData);
+	}
+	else
+	{
+		np.setTypeId(DPT_WORKER_DATA_BATCH);
+		np.setData(mPendingBatch);
+	}
+
+	mPendingBatch.clear();
+	mPendingBatchFirstData.clear();
+	mPendingBatchCount = 0;
+
+	return sendCompressiblePacket(np);
+}
+
+bool WorkerProcessHost::sendCompressiblePacket(NetworkPacket & _np)
+{
+	QByteArray packed;
+	if (mCompressionCodec != CC_NONE
+		&& _np.dataPtr()->size() >= mCompressionThreshold
+		&& ComputeGridGlobals::compressPacketData(mCompressionCodec, (DataPacketType)_np.typeId(), *_np.dataPtr(), packed))
+	{
+		NetworkPacket np(NPT_DATA);
+		np.setTypeId(DPT_COMPRESSED);
+		np.setData(packed);
+		return sendPacket(np);
+	}
+
+	return sendPacket(_np);
+}
+
 bool WorkerProcessHost::isNetworkConnected()
 {
 	bool res = false;
@@ -194,202 +607,1009 @@ bool WorkerProcessHost::isNetworkConnected()
 	return res;
 }
 
-void WorkerProcessHost::readProcessAsync()
+void WorkerProcessHost::attachToGrid(QString _archiveFile, const QString & _hash, const QStringList * _removedFiles, const QByteArray * _archiveData)
 {
-	bool run = true;
-	bool canRead = false;
-	while (run)
-	{
-		canRead = false;
-		while (run && !canRead)
-		{
-			mProcessMutex.lock();
-			if (run = (mProcess && !mProcessReadFuture.isCanceled()))
-				canRead = mProcess->canReadLine();
-			mProcessMutex.unlock();
-		}
+	QString err;
+	QStringList args;
 
-		if (run)
+	if (loadProcessArchive(_archiveFile, _hash, _removedFiles, _archiveData))
+	{
+		if (startProcess())
 		{
-			QString cmd;
-
-			mProcessMutex.lock();
-			if (mProcess)
-				cmd = mProcess->readLine();
-			mProcessMutex.unlock();
-
-			if (!cmd.isEmpty())
-				QMetaObject::invokeMethod(this, "handleProcessCommand", Q_ARG(QString, cmd));
-		}
-	}
-}
+			// the manager requeues whatever it had given this worker before it registers again
+			mTaskDeque.clear();
+			mRunningTasks.clear();
+			mCancelledTasks.clear();
 
-void WorkerProcessHost::handleProcessCommand(QString _command)
-{
-	ProcessCommand pc;
-	QStringList args;
+			args.clear();
+			args.append(QString::number(mTaskSlots));
+			args.append(LiteralCompressionCodec[CC_ZLIB_FAST] + "," + LiteralCompressionCodec[CC_ZLIB]);
+			args.append(QString::number(mPrefetchDepth));
+			args.append(QString::number(mPeerServer && !mOfferedArchiveHash.isEmpty() && QFile::exists(archiveCachePath(mOfferedArchiveHash)) ? mPeerPort : 0));
 
-	if (ComputeGridGlobals::parseProcessCommand(_command, pc, args))
-	{
-		NetworkPacket np(NPT_DATA);
+			args.append(QString()); // p5 is unused, the later arguments keep their place
+			args.append("1"); // accepts batches
+			args.append(QString::number(mCreditWindow));
 
-		switch (pc)
-		{
-		case ComputeGrid::PC_WORKER_DATA:
-			np.setTypeId(DPT_WORKER_DATA);
-			break;
+			//writeToProcess(PC_GRID_WORKER_IN);
 
-		case ComputeGrid::PC_LOG:
-			np.setTypeId(DPT_LOG);
-			emit log(QString("%1").arg(args[2]), (LogType)(args[1].toUInt()), (LogSource)(args[0].toUInt()));
-			break;
+			emit workerInGrid();
 
-		case ComputeGrid::PC_STATUS_MESSAGE:
-			emit statusMessage(args[0]);
-			return; // RETURN!
+			NetworkPacket np(NPT_DATA);
+			np.setTypeId(DPT_GRID_WORKER_READY);
+			QDataStream dsOut(np.dataPtr(), QIODevice::WriteOnly);
+			dsOut << args;
+			sendPacket(np);
 
-		default:
-			emit log("Unknown process command: " + _command, LT_WARNING);
-			return; // RETURN!
+			// from now on the manager sends no more than the window and what's granted back
+			mCreditOwed = 0;
 		}
-
-		QDataStream ds(np.dataPtr(), QIODevice::WriteOnly);
-		ds << args;
-		sendPacket(np);
+		else
+			err = "Worker process start error!";
 	}
+	else
+		err = "Worker archive extract error!";
+
+	if (!err.isEmpty())
+		reportGridError(err);
 }
 
-#pragma region Slots
-void WorkerProcessHost::processStarted()
+// Logged here and on the Grid-Manager.
+void WorkerProcessHost::reportGridError(const QString & _err)
 {
-	emit log("Process started.");
+	NetworkPacket np(NPT_DATA);
+	np.setTypeId(DPT_LOG);
+	QDataStream ds(np.dataPtr(), QIODevice::WriteOnly);
+	ds << (QStringList() << QString::number(LS_GW) << QString::number(LT_ERROR) << _err);
+	sendDataPacket(np);
+
+	emit log(_err, LT_ERROR);
 }
 
-void WorkerProcessHost::processFinished(int _exitCode, QProcess::ExitStatus _exitStatus)
+// Empty for anything that isn't an archive hash.
+QString WorkerProcessHost::archiveCachePath(const QString & _hash)
 {
-	emit log(
-		QString("Process finished. Exit-Code:%1 (%2)").arg(_exitCode).arg(_exitStatus == QProcess::NormalExit ? "Normal Exit" : "Crash Exit"),
-		_exitStatus == QProcess::NormalExit ? LT_INFO : LT_ERROR
-	);
+	QString dir = mDataDirectory + "/cache";
+	if (_hash.isEmpty())
+		return dir;
 
-	if (isNetworkConnected())
+	return ComputeGridGlobals::isArchiveHash(_hash) ? dir + "/" + _hash + ".zip" : QString();
+}
+
+// Keeps the most recently received archives only, and the part of the archive on offer.
+void WorkerProcessHost::pruneArchiveCache()
+{
+	QDir dir(archiveCachePath());
+	QFileInfoList archives = dir.entryInfoList(QStringList() << "*.zip", QDir::Files, QDir::Time);
+	for (int i = ArchiveCacheSize; i < archives.count(); ++i)
+		QFile::remove(archives[i].absoluteFilePath());
+
+	// parts of archives no longer offered would never be resumed
+	QFileInfoList parts = dir.entryInfoList(QStringList() << "*.zip.part", QDir::Files);
+	for (QFileInfoList::const_iterator it = parts.constBegin(); it != parts.constEnd(); ++it)
 	{
-		NetworkPacket np(NPT_DATA);
-		np.setTypeId(DPT_WORKER_EXIT);
-		QDataStream ds(np.dataPtr(), QIODevice::WriteOnly);
-		ds << QString::number(_exitCode);
-		ds << QString::number(_exitStatus);
-		sendPacket(np);
+		QString hash = (*it).fileName().section('.', 0, 0);
+		if (hash != mOfferedArchiveHash && hash != mDeltaHash && !(mArchivePart && hash == mRequestedArchiveHash))
+			QFile::remove((*it).absoluteFilePath());
 	}
 }
 
-void WorkerProcessHost::networkConnected()
+// True if the file's sha256 is _hash.
+bool WorkerProcessHost::verifyArchive(const QString & _file, const QString & _hash)
 {
-	emit log(QString("Connected to the Grid-Manager."));
+	QFile f(_file);
+	QCryptographicHash sha(QCryptographicHash::Sha256);
+	if (!f.open(QIODevice::ReadOnly) || !sha.addData(&f))
+		return false;
 
-	mIsAlive = true;
-	mKeepAliveTimer->start(mKeepAliveIntervalMs);
+	f.close();
+
+	return sha.result().toHex() == _hash;
 }
 
-void WorkerProcessHost::networkDisconnected()
+// Trees are never modified once committed, so the manifest stored at install time stands for the tree in use;
+// installations made before trees existed are scanned on every offer.
+QStringList WorkerProcessHost::installedManifest()
 {
-	mKeepAliveTimer->stop();
-	mIsAlive = false;
-
-	emit log(QString("Disconnected from the Grid-Manager."), LT_WARNING);
-	writeToProcess(ComputeGridGlobals::makeProcessCommand(PC_WORKER_EXIT, QString::number(-1)));
+	ProcessInstallation install = installation();
+	QString hash = install.currentHash();
+	if (hash.isEmpty() || !install.hasTree(hash))
+		return treeManifest(install.currentDir());
 
-	stopProcess();
+	if (!install.hasManifest(hash))
+		install.setManifest(hash, treeManifest(install.treeDir(hash)));
 
-	emit workerOutGrid();
+	return install.manifest(hash);
 }
 
-void WorkerProcessHost::networkPacketReceived(NetworkPacket _packet)
+QStringList WorkerProcessHost::treeManifest(const QString & _dir)
 {
-	mIsAlive = true;
+	QStringList manifest;
+	QDir dir(_dir);
 
-	DataPacketType dpt = (DataPacketType)_packet.typeId();
+	QDirIterator it(dir.absolutePath(), QDir::Files | QDir::Hidden, QDirIterator::Subdirectories);
+	while (it.hasNext())
+	{
+		QFile f(it.next());
+		if (!f.open(QIODevice::ReadOnly))
+			continue;
 
-	QStringList args;
-	QDataStream dsIn(_packet.dataPtr(), QIODevice::ReadOnly);
+		QuaCrc32 crc;
+		while (!f.atEnd())
+			crc.update(f.read(1024 * 1024));
 
-	switch (dpt)
-	{
+		manifest.append(ComputeGridGlobals::makeManifestEntry(dir.relativeFilePath(f.fileName()), crc.value(), f.size()));
+		f.close();
+	}
+
+	return manifest;
+}
+
+// Resumes from cache/<hash>.zip.part when an earlier transfer was cut off.
+void WorkerProcessHost::requestArchive(const QString & _hash, qint64 _size)
+{
+	closeArchiveTransfer();
+
+	QDir dir(archiveCachePath());
+	if (!dir.exists() && !dir.mkpath(dir.absolutePath()))
+	{
+		reportGridError(QString("File system I/O error! Directory:'%1' couldn't modify.").arg(dir.absolutePath()));
+		return;
+	}
+
+	mRequestedArchiveHash = _hash;
+	mRequestedArchiveSize = _size;
+	mArchivePart = new QFile(archiveCachePath(mRequestedArchiveHash) + ".part");
+	if (!mArchivePart->open(QIODevice::ReadWrite | QIODevice::Append))
+	{
+		reportGridError(QString("File system I/O error! Archive:'%1' couldn't create.").arg(mArchivePart->fileName()));
+		closeArchiveTransfer();
+		return;
+	}
+
+	if (mArchivePart->size() == mRequestedArchiveSize)
+	{
+		if (verifyArchive(mArchivePart->fileName(), mRequestedArchiveHash))
+		{
+			completeArchiveTransfer();
+			return;
+		}
+
+		emit log(QString("Partial worker archive %1 is corrupt, fetching it again.").arg(mRequestedArchiveHash.left(12)), LT_WARNING);
+	}
+
+	if (mArchivePart->size() >= mRequestedArchiveSize)
+		mArchivePart->resize(0);
+
+	mArchiveResumed = mArchivePart->size() > 0;
+	if (mArchiveResumed)
+		emit log(QString("Resuming worker archive %1 at %2 KB.").arg(mRequestedArchiveHash.left(12)).arg(mArchivePart->size() / 1024));
+
+	sendArchiveRequest(false);
+}
+
+void WorkerProcessHost::sendArchiveRequest(bool _peerFailed)
+{
+	NetworkPacket np(NPT_DATA);
+	np.setTypeId(DPT_GRID_ATTACH_REQUEST);
+	QDataStream ds(np.dataPtr(), QIODevice::WriteOnly);
+	ds << (QStringList() << mRequestedArchiveHash << QString::number(mArchivePart->size()) << (_peerFailed ? "1" : "0"));
+	sendToArchiveSource(np);
+}
+
+bool WorkerProcessHost::sendToArchiveSource(NetworkPacket & _np)
+{
+	if (mPeerSource)
+		return mPeerSource->sendPacket(_np);
+
+	return sendPacket(_np);
+}
+
+void WorkerProcessHost::closeArchivePeer()
+{
+	mPeerStallTimer->stop();
+
+	if (mPeerProbe)
+	{
+		QObject::disconnect(mPeerProbe, nullptr, this, nullptr);
+		mPeerProbe->abort();
+		mPeerProbe->deleteLater();
+		mPeerProbe = nullptr;
+	}
+
+	if (mPeerSource)
+	{
+		QObject::disconnect(mPeerSource, nullptr, this, nullptr);
+		if (mPeerSource->state() != QAbstractSocket::UnconnectedState)
+			mPeerSource->disconnectFromServer();
+
+		mPeerSource->deleteLater();
+		mPeerSource = nullptr;
+	}
+}
+
+// The manager is asked again, from where the peer left off.
+void WorkerProcessHost::abandonArchivePeer()
+{
+	if (!mPeerSource)
+		return;
+
+	emit log(QString("Peer couldn't serve the worker archive, asking the Grid-Manager."), LT_WARNING);
+	closeArchivePeer();
+
+	if (mArchivePart)
+		sendArchiveRequest(true);
+}
+
+void WorkerProcessHost::sendPeerChunks(const QString & _peer)
+{
+	QHash<QString, PeerUpload>::iterator it = mPeerUploads.find(_peer);
+	if (it == mPeerUploads.end())
+		return;
+
+	PeerUpload & u = it.value();
+	QFile f(archiveCachePath(u.hash));
+	if (!f.open(QIODevice::ReadOnly))
+	{
+		mPeerUploads.erase(it);
+		return;
+	}
+
+	while (u.nextOffset < u.size && u.nextOffset - u.ackedOffset < (qint64)ComputeGridGlobals::ArchiveChunkSize * ComputeGridGlobals::ArchiveWindowChunks)
+	{
+		QByteArray chunk;
+		if (!f.seek(u.nextOffset) || (chunk = f.read(ComputeGridGlobals::ArchiveChunkSize)).isEmpty())
+		{
+			mPeerUploads.erase(it);
+			break;
+		}
+
+		NetworkPacket np(NPT_DATA);
+		np.setTypeId(DPT_GRID_ATTACH_CHUNK);
+		QDataStream ds(np.dataPtr(), QIODevice::WriteOnly);
+		ds << (QStringList() << u.hash << QString::number(u.nextOffset) << QString(QCryptographicHash::hash(chunk, QCryptographicHash::Md5).toHex()));
+		ds << chunk;
+
+		if (!mPeerServer->sendPacket(np, u.client))
+			break;
+
+		u.nextOffset += chunk.size();
+	}
+
+	f.close();
+}
+
+void WorkerProcessHost::ackArchiveChunk(bool _resend)
+{
+	NetworkPacket np(NPT_DATA);
+	np.setTypeId(DPT_GRID_ATTACH_ACK);
+	QDataStream ds(np.dataPtr(), QIODevice::WriteOnly);
+	ds << (QStringList() << mRequestedArchiveHash << QString::number(mArchivePart->size()) << (_resend ? "1" : "0"));
+	sendToArchiveSource(np);
+}
+
+void WorkerProcessHost::completeArchiveTransfer()
+{
+	QString hash = mRequestedArchiveHash;
+	qint64 size = mRequestedArchiveSize;
+	bool resumed = mArchiveResumed;
+	QString partFile = mArchivePart->fileName();
+	closeArchiveTransfer();
+
+	if (!verifyArchive(partFile, hash))
+	{
+		QFile::remove(partFile);
+
+		// the part left on disk may have been the bad one, the whole archive is fetched once more
+		if (resumed)
+		{
+			emit log(QString("Resumed worker archive %1 is corrupt, fetching it again.").arg(hash.left(12)), LT_WARNING);
+			requestArchive(hash, size);
+			return;
+		}
+
+		reportGridError(QString("Worker archive doesn't match the offered hash %1.").arg(hash));
+		return;
+	}
+
+	if (hash == mDeltaHash)
+	{
+		QStringList removedFiles = mDeltaRemovedFiles;
+		mDeltaHash.clear();
+		mDeltaRemovedFiles.clear();
+
+		attachToGrid(partFile, mOfferedArchiveHash, &removedFiles);
+		QFile::remove(partFile);
+		return;
+	}
+
+	QFile::remove(archiveCachePath(hash));
+	if (!QFile::rename(partFile, archiveCachePath(hash)))
+	{
+		reportGridError(QString("File system I/O error! Archive:'%1' couldn't rename.").arg(partFile));
+		return;
+	}
+
+	pruneArchiveCache();
+	attachToGrid(archiveCachePath(hash), hash);
+}
+
+// The partial file stays on disk, the next offer of the same archive resumes it.
+void WorkerProcessHost::closeArchiveTransfer()
+{
+	if (mArchivePart)
+	{
+		mArchivePart->close();
+		delete mArchivePart;
+		mArchivePart = nullptr;
+	}
+
+	mRequestedArchiveHash.clear();
+	mRequestedArchiveSize = 0;
+	mArchiveResendOffset = -1;
+	mArchiveResumed = false;
+}
+
+void WorkerProcessHost::startQueuedTasks()
+{
+	while (mRunningTasks.count() < mTaskSlots && !mTaskDeque.isEmpty())
+	{
+		WorkerProcess * process = leastLoadedProcess();
+		if (!process)
+			break;
+
+		QStringList task = mTaskDeque.takeFirst();
+		mRunningTasks.insert(task.first(), process);
+		process->write(PC_TASK, task);
+		process->taskStarted();
+	}
+
+	if (mTaskDeque.isEmpty() && mRunningTasks.count() < mTaskSlots)
+		requestSteal();
+}
+
+void WorkerProcessHost::requestSteal()
+{
+	if (!mWorkStealing || mStealRequested)
+		return;
+
+	mStealRequested = true;
+
+	NetworkPacket np(NPT_DATA);
+	np.setTypeId(DPT_STEAL_REQUEST);
+	QDataStream ds(np.dataPtr(), QIODevice::WriteOnly);
+	ds << (QStringList() << QString::number(mTaskSlots - mRunningTasks.count()));
+	sendDataPacket(np);
+}
+
+// Credit goes back once worker.exe is keeping up with what it's being given.
+void WorkerProcessHost::grantCredit()
+{
+	if (mCreditWindow <= 0 || mCreditOwed < mCreditWindow / 4 || isProcessBackedUp())
+		return;
+
+	NetworkPacket np(NPT_DATA);
+	np.setTypeId(DPT_CREDIT);
+	QDataStream ds(np.dataPtr(), QIODevice::WriteOnly);
+	ds << (QStringList() << QString::number(mCreditOwed));
+	mCreditOwed = 0;
+	sendPacket(np);
+}
+
+bool WorkerProcessHost::isProcessBackedUp()
+{
+	bool res = false;
+
+	mProcessMutex.lock();
+
+	for (QList<WorkerProcess *>::iterator it = mProcesses.begin(); it != mProcesses.end() && !res; ++it)
+		res = (*it)->isBackedUp(mCreditWindow / 2);
+
+	mProcessMutex.unlock();
+
+	return res;
+}
+
+// Null when every session process has its slots full.
+WorkerProcess * WorkerProcessHost::leastLoadedProcess()
+{
+	WorkerProcess * res = nullptr;
+
+	mProcessMutex.lock();
+
+	for (QList<WorkerProcess *>::iterator it = mProcesses.begin(); it != mProcesses.end(); ++it)
+	{
+		if ((*it)->runningTasks() < (*it)->taskSlots() && (*it)->isRunning()
+			&& (!res || (*it)->runningTasks() * res->taskSlots() < res->runningTasks() * (*it)->taskSlots()))
+			res = *it;
+	}
+
+	mProcessMutex.unlock();
+
+	return res;
+}
+
+// The tasks of a session process that died are given back to the manager. A crashed process that had run tasks
+// is restarted in its place; otherwise it leaves the session with its slots, and the worker only exits the grid
+// with its last process. False when there is no session left to keep going.
+bool WorkerProcessHost::replaceSessionProcess(WorkerProcess * _process, QProcess::ExitStatus _exitStatus)
+{
+	int index = mProcesses.indexOf(_process);
+	if (index < 0)
+		return false;
+
+	QStringList lost;
+	for (QHash<QString, WorkerProcess *>::iterator it = mRunningTasks.begin(); it != mRunningTasks.end();)
+	{
+		if (it.value() == _process)
+		{
+			if (!mCancelledTasks.remove(it.key()))
+				lost.append(it.key());
+
+			it = mRunningTasks.erase(it);
+		}
+		else
+			++it;
+	}
+
+	bool connected = isNetworkConnected();
+	if (connected && !lost.isEmpty())
+	{
+		NetworkPacket np(NPT_DATA);
+		np.setTypeId(DPT_TASK_FAILED);
+		QDataStream ds(np.dataPtr(), QIODevice::WriteOnly);
+		ds << lost;
+		sendDataPacket(np);
+	}
+
+	if (connected && _exitStatus == QProcess::CrashExit && _process->tasksRun() > 0 && _process->start(true))
+	{
+		emit log(QString("Worker process restarted (pid %1), %2 tasks given back.").arg(_process->processId()).arg(lost.count()), LT_WARNING);
+		_process->beginSession(_process->taskSlots(), _process->affinityMask());
+		startQueuedTasks();
+		return true;
+	}
+
+	if (mProcesses.count() == 1)
+		return false;
+
+	mProcessMutex.lock();
+	mProcesses.removeAt(index);
+	mProcessMutex.unlock();
+
+	mTaskSlots = qMax(0, mTaskSlots - _process->taskSlots());
+	retireProcess(_process);
+
+	if (connected)
+	{
+		NetworkPacket np(NPT_DATA);
+		np.setTypeId(DPT_WORKER_SLOTS);
+		QDataStream ds(np.dataPtr(), QIODevice::WriteOnly);
+		ds << (QStringList() << QString::number(mTaskSlots));
+		sendDataPacket(np);
+
+		startQueuedTasks();
+	}
+
+	return true;
+}
+
+void WorkerProcessHost::handleProcessCommand(ComputeGrid::ProcessMessage & _message)
+{
+	QStringList & args = _message.args;
+	NetworkPacket np(NPT_DATA);
+
+	switch (_message.command)
+	{
+	case ComputeGrid::PC_WORKER_DATA:
+		np.setTypeId(DPT_WORKER_DATA);
+		break;
+
+	case ComputeGrid::PC_TASK_RESULT:
+		np.setTypeId(DPT_TASK_RESULT);
+		if (!args.isEmpty())
+		{
+			WorkerProcess * process = mRunningTasks.take(args.first());
+			if (process)
+				process->taskFinished();
+
+			if (mCancelledTasks.remove(args.first()))
+			{
+				startQueuedTasks(); // the manager has the result of another copy already
+				return; // RETURN!
+			}
+		}
+		break;
+
+	case ComputeGrid::PC_TASK_CANCEL:
+		if (!args.isEmpty() && mCancelledTasks.remove(args.first()))
+		{
+			WorkerProcess * process = mRunningTasks.take(args.first());
+			if (process)
+				process->taskFinished();
+
+			startQueuedTasks();
+		}
+		return; // RETURN!
+
+	case ComputeGrid::PC_WORKER_RAW_DATA:
+		np.setTypeId(DPT_WORKER_RAW_DATA);
+		np.setData(_message.data);
+		sendDataPacket(np);
+		return; // RETURN!
+
+	case ComputeGrid::PC_LOG:
+		np.setTypeId(DPT_LOG);
+		emit log(QString("%1").arg(args[2]), (LogType)(args[1].toUInt()), (LogSource)(args[0].toUInt()));
+		break;
+
+	case ComputeGrid::PC_STATUS_MESSAGE:
+		emit statusMessage(args[0]);
+		return; // RETURN!
+
+	default:
+		emit log("Unknown process command: " + LiteralProcessCommand[_message.command], LT_WARNING);
+		return; // RETURN!
+	}
+
+	QDataStream ds(np.dataPtr(), QIODevice::WriteOnly);
+	ds << args;
+
+	if (np.typeId() == DPT_WORKER_DATA || np.typeId() == DPT_TASK_RESULT || np.typeId() == DPT_LOG)
+		sendDataPacket(np);
+	else
+		sendPacket(np);
+
+	if (np.typeId() == DPT_TASK_RESULT)
+		startQueuedTasks();
+}
+
+#pragma region Slots
+// Idle processes have no session to talk to, only their logs and reset confirmations are kept.
+void WorkerProcessHost::processMessageReceived(ComputeGrid::ProcessMessage _message)
+{
+	WorkerProcess * process = qobject_cast<WorkerProcess *>(sender());
+
+	if (mProcesses.contains(process))
+		handleProcessCommand(_message);
+	else if (_message.command == PC_SESSION_RESET && mIdleProcesses.contains(process))
+		process->markClean();
+	else if (_message.command == PC_LOG && _message.args.count() > 2)
+		emit log(QString("%1").arg(_message.args[2]), (LogType)(_message.args[1].toUInt()), (LogSource)(_message.args[0].toUInt()));
+}
+
+void WorkerProcessHost::processBytesWritten(qint64 _bytes)
+{
+	Q_UNUSED(_bytes);
+	grantCredit();
+}
+
+void WorkerProcessHost::processStarted()
+{
+	emit log("Process started.");
+}
+
+void WorkerProcessHost::processFinished(int _exitCode, QProcess::ExitStatus _exitStatus)
+{
+	WorkerProcess * process = qobject_cast<WorkerProcess *>(sender());
+	if (process && !mProcesses.contains(process))
+	{
+		// a warm process died before getting a session; it is replaced when the pool is filled next
+		emit log(QString("Idle worker process exited. Exit-Code:%1").arg(_exitCode), LT_WARNING);
+		mIdleProcesses.removeOne(process);
+		QObject::disconnect(process, nullptr, this, nullptr);
+		process->deleteLater();
+		return; // RETURN!
+	}
+
+	emit log(
+		QString("Process finished. Exit-Code:%1 (%2)").arg(_exitCode).arg(_exitStatus == QProcess::NormalExit ? "Normal Exit" : "Crash Exit"),
+		_exitStatus == QProcess::NormalExit ? LT_INFO : LT_ERROR
+	);
+
+	if (process && replaceSessionProcess(process, _exitStatus))
+		return; // RETURN!
+
+	if (isNetworkConnected())
+	{
+		flushBatch();
+
+		NetworkPacket np(NPT_DATA);
+		np.setTypeId(DPT_WORKER_EXIT);
+		QDataStream ds(np.dataPtr(), QIODevice::WriteOnly);
+		ds << QString::number(_exitCode);
+		ds << QString::number(_exitStatus);
+		sendPacket(np);
+	}
+}
+
+void WorkerProcessHost::networkConnected()
+{
+	emit log(QString("Connected to the Grid-Manager."));
+
+	// until the manager tells its heartbeat interval, expect one every keep-alive interval
+	mHeartbeatIntervalMs = 0;
+	mManagerDetector.reset(mKeepAliveIntervalMs);
+	mManagerDetector.heartbeat(mClock.elapsed());
+	mKeepAliveTimer->start(mKeepAliveIntervalMs);
+}
+
+void WorkerProcessHost::networkDisconnected()
+{
+	mKeepAliveTimer->stop();
+	mBatchTimer->stop();
+	mPendingBatch.clear();
+	mPendingBatchFirstData.clear();
+	mPendingBatchCount = 0;
+	mManagerBatching = false;
+	mCompressionCodec = CC_NONE;
+	mTaskDeque.clear();
+	mRunningTasks.clear();
+	mCancelledTasks.clear();
+	mWorkStealing = false;
+	mStealRequested = false;
+	mStealBackoffMs = StealRetryMs;
+	mCreditOwed = 0;
+	mHeartbeatIntervalMs = 0;
+	closeArchiveTransfer();
+	closeArchivePeer();
+	mOfferedArchiveHash.clear();
+	mDeltaHash.clear();
+	mDeltaRemovedFiles.clear();
+
+	emit log(QString("Disconnected from the Grid-Manager."), LT_WARNING);
+
+	stopProcess();
+
+	emit workerOutGrid();
+}
+
+void WorkerProcessHost::networkPacketReceived(NetworkPacket _packet)
+{
+	// only heartbeats are interval samples, other traffic just shows the manager is alive
+	if (_packet.typeId() == DPT_HEARTHBEAT)
+		mManagerDetector.heartbeat(mClock.elapsed());
+	else
+		mManagerDetector.seen(mClock.elapsed());
+
+	if (mCreditWindow > 0 && ComputeGridGlobals::isCreditedPacket((DataPacketType)_packet.typeId(), *_packet.dataPtr()))
+		mCreditOwed += _packet.dataPtr()->size();
+
+	handleDataPacket(_packet);
+	grantCredit();
+}
+
+void WorkerProcessHost::handleDataPacket(NetworkPacket & _packet)
+{
+	DataPacketType dpt = (DataPacketType)_packet.typeId();
+
+	QStringList args;
+	QDataStream dsIn(_packet.dataPtr(), QIODevice::ReadOnly);
+
+	switch (dpt)
+	{
 	case ComputeGrid::DPT_HEARTHBEAT:
+		sendPacket(_packet); // echoed for the manager's RTT measurement
 		break;
 
-	case ComputeGrid::DPT_GRID_ATTACH:
+	case ComputeGrid::DPT_GRID_ATTACH_OFFER:
+	{
+		args.clear();
+		dsIn >> args;
+		if (args.count() < 2 || !ComputeGridGlobals::isArchiveHash(args[0]))
+			break;
+
+		// the archive was replaced while the old one (or a delta to it) was still coming, that transfer is of no use now
+		if (mArchivePart && mOfferedArchiveHash != args[0])
+		{
+			emit log(QString("Worker archive changed during the transfer of %1, starting over with %2.").arg(mOfferedArchiveHash.left(12)).arg(args[0].left(12)), LT_WARNING);
+			closeArchivePeer();
+			closeArchiveTransfer();
+		}
+
+		mOfferedArchiveHash = args[0];
+
+		if (installation().hasTree(args[0]))
+		{
+			// extracted before, the archive itself isn't needed
+			attachToGrid(QString(), args[0]);
+			break;
+		}
+
+		QFileInfo cached(archiveCachePath(args[0]));
+		if (cached.exists())
+		{
+			if (cached.size() == args[1].toLongLong() && verifyArchive(cached.absoluteFilePath(), args[0]))
+			{
+				emit log(QString("Worker archive %1 found in the cache.").arg(args[0].left(12)));
+				attachToGrid(cached.absoluteFilePath(), args[0]);
+				break;
+			}
+
+			emit log(QString("Cached worker archive %1 is corrupt, it is removed.").arg(args[0].left(12)), LT_WARNING);
+			QFile::remove(cached.absoluteFilePath());
+		}
+
+		mDeltaHash.clear();
+		mDeltaRemovedFiles.clear();
+		pruneArchiveCache();
+
+		if (!QFile::exists(installation().executable()))
+		{
+			requestArchive(args[0], args[1].toLongLong());
+			break;
+		}
+
+		// an older version is installed, only what differs has to come
+		closeArchiveTransfer();
+
+		NetworkPacket np(NPT_DATA);
+		np.setTypeId(DPT_GRID_ATTACH_MANIFEST);
+		QDataStream dsOut(np.dataPtr(), QIODevice::WriteOnly);
+		dsOut << (QStringList() << args[0] << installedManifest());
+		sendPacket(np);
+	}
+	break;
+
+	case ComputeGrid::DPT_GRID_ATTACH_DELTA:
 	{
-		QString err;
-		QDir dir(QStandardPaths::writableLocation(QStandardPaths::AppDataLocation));
-		if (!dir.exists() && !dir.mkpath(dir.absolutePath()))
-			err = QString("File system I/O error! Directory:'%1' couldn't modify.").arg(dir.absolutePath());
+		args.clear();
+		dsIn >> args;
+		if (args.count() < 3 || args[0] != mOfferedArchiveHash)
+			break; // answer to an offer that has been replaced since
+
+		if (args[1] == args[0])
+			requestArchive(args[0], args[2].toLongLong());
+		else if (args[1].isEmpty())
+		{
+			emit log(QString("Installed worker files are up to date with %1.").arg(args[0].left(12)));
+
+			QStringList removedFiles = args.mid(3);
+			attachToGrid(QString(), args[0], &removedFiles);
+		}
 		else
 		{
-			QFile f(dir.absolutePath() + "/worker.zip");
-			if (f.open(QIODevice::WriteOnly))
+			emit log(QString("Updating the installed worker files with a %1 KB delta.").arg(args[2].toLongLong() / 1024));
+
+			if (!ComputeGridGlobals::isArchiveHash(args[1]))
+				break;
+
+			mDeltaHash = args[1];
+			mDeltaRemovedFiles = args.mid(3);
+			requestArchive(mDeltaHash, args[2].toLongLong());
+		}
+	}
+	break;
+
+	case ComputeGrid::DPT_GRID_ATTACH_CHUNK:
+	{
+		QByteArray chunk;
+		args.clear();
+		dsIn >> args >> chunk;
+		if (args.count() < 3 || !mArchivePart || args[0] != mRequestedArchiveHash)
+			break;
+
+		qint64 offset = args[1].toLongLong();
+		if (offset != mArchivePart->size())
+			break; // sent before the manager saw our resend request
+
+		if (QCryptographicHash::hash(chunk, QCryptographicHash::Md5).toHex() != args[2])
+		{
+			if (mArchiveResendOffset != offset)
 			{
-				f.write(*_packet.dataPtr());
-				f.close();
-
-				if (loadProcessArchive())
-				{
-					if (startProcess())
-					{
-						args.clear();
-						args.append(QString::number(QThread::idealThreadCount()));
-
-						//writeToProcess(ComputeGridGlobals::makeProcessCommand(PC_GRID_WORKER_IN, QString()));
-
-						emit workerInGrid();
-
-						NetworkPacket np(NPT_DATA);
-						np.setTypeId(DPT_GRID_WORKER_READY);
-						QDataStream dsOut(np.dataPtr(), QIODevice::WriteOnly);
-						dsOut << args;
-						sendPacket(np);
-					}
-					else
-						err = "Worker process start error!";
-				}
-				else
-					err = "Worker archive extract error!";
+				mArchiveResendOffset = offset;
+				ackArchiveChunk(true);
 			}
-			else
-				err = QString("File system I/O error! Worker archive couldn't create at directory: %1").arg(dir.absolutePath());
+			break;
 		}
 
-		if (!err.isEmpty())
+		mArchiveResendOffset = -1;
+		if (mArchivePart->write(chunk) != chunk.size() || !mArchivePart->flush())
 		{
-			args.clear();
-			args.append(QString::number(LS_GW));
-			args.append(QString::number(LT_ERROR));
-			args.append(err);
-			NetworkPacket np(NPT_DATA);
-			np.setTypeId(DPT_LOG);
-			QDataStream dsOut(np.dataPtr(), QIODevice::WriteOnly);
-			dsOut << args;
-			sendPacket(np);
+			reportGridError(QString("File system I/O error! Archive:'%1' couldn't write.").arg(mArchivePart->fileName()));
+			closeArchiveTransfer();
+			break;
+		}
+
+		ackArchiveChunk(false);
 
-			emit log(err, LT_ERROR);
+		if (mArchivePart->size() >= mRequestedArchiveSize)
+		{
+			if (mPeerSource)
+			{
+				closeArchivePeer();
+				ackArchiveChunk(false); // the manager frees the peer's upload slot
+			}
+
+			completeArchiveTransfer();
 		}
 	}
 	break;
 
+	case ComputeGrid::DPT_GRID_ATTACH_PEER:
+	{
+		args.clear();
+		dsIn >> args;
+		if (args.count() < 4 || !mArchivePart || args[0] != mRequestedArchiveHash)
+			break;
+
+		closeArchivePeer();
+
+		emit log(QString("Fetching the worker archive from peer %1:%2.").arg(args[1]).arg(args[2]));
+
+		mPeerSource = new NetworkClient(args[1], args[2].toUShort());
+		QObject::connect(mPeerSource, SIGNAL(connected()), this, SLOT(peerSourceConnected()));
+		QObject::connect(mPeerSource, SIGNAL(disconnected()), this, SLOT(peerSourceDisconnected()));
+		QObject::connect(mPeerSource, SIGNAL(packetReceived(NetworkPacket)), this, SLOT(peerSourcePacketReceived(NetworkPacket)));
+		QObject::connect(mPeerSource, SIGNAL(error(QAbstractSocket::SocketError)), this, SLOT(peerSourceError(QAbstractSocket::SocketError)));
+
+		// connectToServer() blocks, so a probe finds out without blocking whether the peer answers at all
+		mPeerProbe = new QTcpSocket(this);
+		QObject::connect(mPeerProbe, SIGNAL(connected()), this, SLOT(peerProbeConnected()));
+		QObject::connect(mPeerProbe, SIGNAL(error(QAbstractSocket::SocketError)), this, SLOT(peerProbeError(QAbstractSocket::SocketError)));
+		mPeerProbe->connectToHost(args[1], args[2].toUShort());
+		mPeerStallTimer->start(PeerConnectTimeOutMs);
+	}
+	break;
+
+	case ComputeGrid::DPT_GRID_ATTACH:
+	{
+		// managers without the cache handshake send the archive unasked and whole; it is extracted from the packet
+		QString hash = QCryptographicHash::hash(*_packet.dataPtr(), QCryptographicHash::Sha256).toHex();
+		attachToGrid(QString("worker archive %1").arg(hash.left(12)), hash, nullptr, _packet.dataPtr());
+	}
+	break;
+
 	case ComputeGrid::DPT_WORKER_DATA:
 		args.clear();
 		dsIn >> args;
 		args.removeFirst(); // remove worker info
-		writeToProcess(ComputeGridGlobals::makeProcessCommand(PC_WORKER_DATA, args));
+		writeToProcess(PC_WORKER_DATA, args);
 		break;
 
 	case ComputeGrid::DPT_WORKER_EXIT:
 		args.clear();
 		dsIn >> args;
 		args.removeFirst(); // remove worker info
-		writeToProcess(ComputeGridGlobals::makeProcessCommand(PC_WORKER_EXIT, args));
+		writeToProcess(PC_WORKER_EXIT, args);
+		break;
+
+	case ComputeGrid::DPT_TASK_CANCEL:
+	{
+		args.clear();
+		dsIn >> args;
+		if (args.isEmpty())
+			break;
+
+		// a cancelled task that hasn't started yet never reaches worker.exe
+		bool queued = false;
+		for (QList<QStringList>::iterator it = mTaskDeque.begin(); it != mTaskDeque.end(); ++it)
+		{
+			if ((*it).first() == args.first())
+			{
+				mTaskDeque.erase(it);
+				queued = true;
+				break;
+			}
+		}
+
+		// a running one keeps its slot until its process confirms the cancel or sends the result anyway
+		WorkerProcess * process = queued ? nullptr : mRunningTasks.value(args.first());
+		if (process && !mCancelledTasks.contains(args.first()))
+		{
+			mCancelledTasks.insert(args.first());
+			process->write(PC_TASK_CANCEL, QStringList() << args.first());
+		}
+	}
+	break;
+
+	case ComputeGrid::DPT_WORKER_RAW_DATA:
+		writeToProcess(PC_WORKER_RAW_DATA, QStringList(), *_packet.dataPtr());
+		break;
+
+	case ComputeGrid::DPT_TASK:
+		args.clear();
+		dsIn >> args;
+		if (!args.isEmpty())
+		{
+			mStealBackoffMs = StealRetryMs; // work is coming in again
+			mTaskDeque.append(args);
+			startQueuedTasks();
+		}
+		break;
+
+	case ComputeGrid::DPT_STEAL_REVOKE:
+	{
+		args.clear();
+		dsIn >> args;
+
+		QStringList revoked;
+		int count = args.count() > 0 ? args[0].toInt() : 0;
+		while (count-- > 0 && !mTaskDeque.isEmpty())
+			revoked.append(mTaskDeque.takeLast().first());
+
+		NetworkPacket np(NPT_DATA);
+		np.setTypeId(DPT_STEAL_REVOKE);
+		QDataStream dsOut(np.dataPtr(), QIODevice::WriteOnly);
+		dsOut << revoked;
+		sendDataPacket(np);
+	}
+	break;
+
+	case ComputeGrid::DPT_STEAL_GRANT:
+		args.clear();
+		dsIn >> args;
+		mStealRequested = false;
+
+		// nothing to steal: back off, an idle grid isn't asked twice a second by every worker
+		if (args.count() > 0 && args[0].toInt() == 0)
+		{
+			QTimer::singleShot(mStealBackoffMs, this, SLOT(stealRetryTimeout()));
+			mStealBackoffMs = qMin(mStealBackoffMs * 2, StealRetryMaxMs);
+		}
+		else
+		{
+			mStealBackoffMs = StealRetryMs;
+			startQueuedTasks();
+		}
 		break;
 
+	case ComputeGrid::DPT_GRID_CONFIG:
+	{
+		args.clear();
+		dsIn >> args;
+
+		int codec = args.count() > 0 ? LiteralCompressionCodec.indexOf(args[0]) : -1;
+		mCompressionCodec = codec > 0 ? (CompressionCodec)codec : CC_NONE;
+		mCompressionThreshold = args.count() > 1 ? args[1].toInt() : 0;
+		mWorkStealing = args.count() > 2 && args[2] == "1";
+		mManagerBatching = args.count() > 4 && args[4] == "1";
+
+		if (args.count() > 3 && args[3].toInt() > 0)
+		{
+			mHeartbeatIntervalMs = args[3].toInt();
+			mManagerDetector.reset(mHeartbeatIntervalMs);
+			mManagerDetector.heartbeat(mClock.elapsed());
+			mKeepAliveTimer->start(qMax(50, mHeartbeatIntervalMs / 2));
+		}
+
+		if (mWorkStealing)
+			startQueuedTasks();
+	}
+	break;
+
+	case ComputeGrid::DPT_COMPRESSED:
+	{
+		DataPacketType type;
+		QByteArray data;
+		if (ComputeGridGlobals::decompressPacketData(*_packet.dataPtr(), type, data))
+		{
+			NetworkPacket np(NPT_DATA);
+			np.setTypeId(type);
+			np.setData(data);
+			handleDataPacket(np);
+		}
+		else
+			emit log(QString("Malformed compressed packet received from the Grid-Manager."), LT_WARNING);
+	}
+	break;
+
+	case ComputeGrid::DPT_WORKER_DATA_BATCH:
+	{
+		QList<QPair<DataPacketType, QByteArray>> entries;
+		if (!ComputeGridGlobals::parseBatch(*_packet.dataPtr(), entries))
+			emit log(QString("Malformed batch packet received from the Grid-Manager."), LT_WARNING);
+
+		for (QList<QPair<DataPacketType, QByteArray>>::iterator it = entries.begin(); it != entries.end(); ++it)
+		{
+			NetworkPacket np(NPT_DATA);
+			np.setTypeId((*it).first);
+			np.setData((*it).second);
+			handleDataPacket(np);
+		}
+	}
+	break;
+
 	default:
 		emit log(QString("Unknown network packet received from the Grid-Manager."), LT_WARNING);
 		break;
@@ -403,11 +1623,153 @@ void WorkerProcessHost::networkError(QAbstractSocket::SocketError _socketError)
 	// to do: consider restart?
 }
 
+void WorkerProcessHost::peerSourceConnected()
+{
+	if (mArchivePart)
+		sendArchiveRequest(false);
+}
+
+void WorkerProcessHost::peerSourceDisconnected()
+{
+	abandonArchivePeer();
+}
+
+void WorkerProcessHost::peerSourceError(QAbstractSocket::SocketError _socketError)
+{
+	Q_UNUSED(_socketError);
+	abandonArchivePeer();
+}
+
+void WorkerProcessHost::peerSourcePacketReceived(NetworkPacket _packet)
+{
+	if (_packet.typeId() == DPT_GRID_ATTACH_CHUNK)
+	{
+		mPeerStallTimer->start(PeerStallTimeOutMs);
+		handleDataPacket(_packet);
+	}
+	else if (_packet.typeId() == DPT_GRID_ATTACH_PEER)
+		abandonArchivePeer(); // it doesn't hold the archive
+}
+
+// The peer listens, connecting to it now takes a round trip at most.
+void WorkerProcessHost::peerProbeConnected()
+{
+	mPeerProbe->deleteLater();
+	mPeerProbe = nullptr;
+
+	mPeerStallTimer->start(PeerStallTimeOutMs);
+	if (!mPeerSource->connectToServer(PeerConnectTimeOutMs))
+		abandonArchivePeer();
+}
+
+void WorkerProcessHost::peerProbeError(QAbstractSocket::SocketError _socketError)
+{
+	Q_UNUSED(_socketError);
+	abandonArchivePeer();
+}
+
+void WorkerProcessHost::peerStallTimeout()
+{
+	emit log(QString("Peer sent nothing for %1 ms.").arg(mPeerProbe ? PeerConnectTimeOutMs : PeerStallTimeOutMs), LT_WARNING);
+	abandonArchivePeer();
+}
+
+void WorkerProcessHost::peerClientDisconnected(NetworkClientInfo _clientInfo)
+{
+	mPeerUploads.remove(_clientInfo.toString());
+}
+
+// Other workers fetch cached archives with the same request/chunk/ack exchange the manager serves.
+void WorkerProcessHost::peerPacketReceived(NetworkClientInfo _clientInfo, NetworkPacket _packet)
+{
+	QStringList args;
+	QDataStream dsIn(_packet.dataPtr(), QIODevice::ReadOnly);
+	dsIn >> args;
+
+	QString peer = _clientInfo.toString();
+
+	switch (_packet.typeId())
+	{
+	case ComputeGrid::DPT_GRID_ATTACH_REQUEST:
+	{
+		QFileInfo cached(archiveCachePath(args.value(0)));
+		if (args.isEmpty() || !ComputeGridGlobals::isArchiveHash(args[0]) || !cached.exists())
+		{
+			NetworkPacket np(NPT_DATA);
+			np.setTypeId(DPT_GRID_ATTACH_PEER);
+			mPeerServer->sendPacket(np, _clientInfo);
+			break;
+		}
+
+		PeerUpload u;
+		u.client = _clientInfo;
+		u.hash = args[0];
+		u.size = cached.size();
+		u.nextOffset = qBound<qint64>(0, args.value(1).toLongLong(), u.size);
+		u.ackedOffset = u.nextOffset;
+		mPeerUploads.insert(peer, u);
+
+		emit log(QString("Serving the worker archive to peer %1.").arg(peer));
+		sendPeerChunks(peer);
+	}
+	break;
+
+	case ComputeGrid::DPT_GRID_ATTACH_ACK:
+	{
+		QHash<QString, PeerUpload>::iterator it = mPeerUploads.find(peer);
+		if (args.count() < 3 || it == mPeerUploads.end() || args[0] != it.value().hash)
+			break;
+
+		qint64 offset = args[1].toLongLong();
+		if (args[2] == "1")
+		{
+			it.value().nextOffset = offset;
+			it.value().ackedOffset = offset;
+		}
+		else
+			it.value().ackedOffset = qMax(it.value().ackedOffset, offset);
+
+		if (it.value().ackedOffset >= it.value().size)
+			mPeerUploads.erase(it);
+		else
+			sendPeerChunks(peer);
+	}
+	break;
+
+	default:
+		break;
+	}
+}
+
+void WorkerProcessHost::batchTimerTimeout()
+{
+	flushBatch();
+}
+
+void WorkerProcessHost::stealRetryTimeout()
+{
+	if (isNetworkConnected() && mTaskDeque.isEmpty() && mRunningTasks.count() < mTaskSlots)
+		requestSteal();
+}
+
 void WorkerProcessHost::keepAliveTimerTimeout()
 {
-	if (!mIsAlive)
+	qint64 now = mClock.elapsed();
+
+	double phi = mManagerDetector.phi(now);
+	if (phi > mFailureThreshold)
+	{
+		emit log(QString("Grid-Manager is suspected to be down (phi %1).").arg(phi, 0, 'f', 1), LT_WARNING);
 		QMetaObject::invokeMethod(this, "disconnectFromNetworkServer");
-	
-	mIsAlive = false;
+		return;
+	}
+
+	// an idle worker tells it's alive; any other packet does the same job
+	if (mHeartbeatIntervalMs > 0 && now - mLastSentMs >= mHeartbeatIntervalMs)
+	{
+		NetworkPacket np(NPT_DATA);
+		np.setTypeId(DPT_HEARTHBEAT);
+		sendPacket(np);
+	}
 }
 #pragma endregion
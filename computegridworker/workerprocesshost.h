@@ -3,11 +3,20 @@
 #include <QObject>
 #include <QProcess>
 #include <QMutex>
-#include <QFuture>
 #include <QStringList>
+#include <QHash>
+#include <QSet>
+#include <QByteArray>
 #include <QTimer>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QTcpSocket>
 #include "computegridcommons.hpp"
+#include "workerprocess.h"
+#include "failuredetector.hpp"
+#include "processinstallation.hpp"
 #include "networkclient.h"
+#include "networkserver.h"
 
 using namespace Networking;
 
@@ -15,7 +24,23 @@ class WorkerProcessHost : public QObject
 {
 	Q_OBJECT
 
+	struct PeerUpload
+	{
+		NetworkClientInfo client;
+		QString hash;
+		qint64 size;
+		qint64 nextOffset;
+		qint64 ackedOffset;
+	};
+
 public:
+	enum AffinityMode
+	{
+		AM_NONE,	// processes share all cores
+		AM_CORES,	// each process gets its own slice of the cores
+		AM_NUMA		// each process gets a NUMA node, round-robin
+	};
+
 	WorkerProcessHost(int _keepAliveIntervalMs = 300000, QObject * _parent = nullptr);
 	~WorkerProcessHost();
 
@@ -24,25 +49,119 @@ public:
 
 	bool startProcess();
 	bool stopProcess();
-	void writeToProcess(QString _cmd);
-	bool loadProcessArchive();
+	void writeToProcess(ComputeGrid::ProcessCommand _pc, QStringList _args = QStringList(), const QByteArray & _data = QByteArray());
+	void setBinaryFraming(bool _enabled);
+	void setSharedMemoryTransport(bool _enabled);
+	void setBatching(int _maxBytes, int _lingerMs);
+	void setPrefetchDepth(int _depth);
+	void setCreditWindow(qint64 _bytes);
+	void setFailureThreshold(double _phiThreshold);
+	void setPeerPort(quint16 _port);
+	void setDataDirectory(const QString & _dir);
+	void setProcessPool(int _size, int _recycleTasks, qint64 _recycleMemoryBytes);
+	void setProcesses(int _count, AffinityMode _affinity);
+	bool loadProcessArchive(QString _archiveFile, QString _hash = QString(), const QStringList * _removedFiles = nullptr, const QByteArray * _archiveData = nullptr);
 
 private:
 	bool sendPacket(NetworkPacket & _np);
+	bool sendDataPacket(NetworkPacket & _np);
+	bool sendCompressiblePacket(NetworkPacket & _np);
+	bool flushBatch();
 	bool isNetworkConnected();
+	void startQueuedTasks();
+	void requestSteal();
+	void grantCredit();
+	bool isProcessBackedUp();
+	WorkerProcess * leastLoadedProcess();
+	bool replaceSessionProcess(WorkerProcess * _process, QProcess::ExitStatus _exitStatus);
+	void handleDataPacket(NetworkPacket & _packet);
+	void attachToGrid(QString _archiveFile, const QString & _hash, const QStringList * _removedFiles = nullptr, const QByteArray * _archiveData = nullptr);
+	ComputeGrid::ProcessInstallation installation();
+	void reportGridError(const QString & _err);
+	QString archiveCachePath(const QString & _hash = QString());
+	void pruneArchiveCache();
+	bool verifyArchive(const QString & _file, const QString & _hash);
+	QStringList installedManifest();
+	QStringList treeManifest(const QString & _dir);
+	void requestArchive(const QString & _hash, qint64 _size);
+	void sendArchiveRequest(bool _peerFailed);
+	bool sendToArchiveSource(NetworkPacket & _np);
+	void closeArchivePeer();
+	void abandonArchivePeer();
+	void sendPeerChunks(const QString & _peer);
+	void ackArchiveChunk(bool _resend);
+	void completeArchiveTransfer();
+	void closeArchiveTransfer();
+	WorkerProcess * createProcess(const QString & _dir);
+	void fillProcessPool();
+	void clearProcessPool();
+	void retireProcess(WorkerProcess * _process);
+	bool isReusable(WorkerProcess * _process);
 
-	void readProcessAsync();
-	Q_INVOKABLE void handleProcessCommand(QString _command);
+	void handleProcessCommand(ComputeGrid::ProcessMessage & _message);
 
-	QProcess * mProcess;
-	QFuture<void> mProcessReadFuture;
+	QList<WorkerProcess *> mProcesses; // serve the grid session, tasks go to the least loaded
+	QList<quint64> mProcessAffinity; // cores of each session process, 0 for all
+	QList<int> mProcessSlots; // task slots of each session process
+	QList<WorkerProcess *> mIdleProcesses; // warm, started in the current tree, waiting for the next session
+	int mProcessPoolSize;
+	int mRecycleTasks; // a process is retired after this many tasks, 0 never
+	qint64 mRecycleMemoryBytes; // or once its working set grows past this, 0 never
+	bool mBinaryFraming; // worker.exe understands ProcessArgBinaryFraming
+	bool mUseSharedMemory;
 	NetworkClient * mNetClient;
 	QTimer * mKeepAliveTimer;
 	int mKeepAliveIntervalMs;
-	bool mIsAlive;
+	ComputeGrid::PhiAccrualDetector mManagerDetector;
+	double mFailureThreshold;
+	int mHeartbeatIntervalMs; // set by DPT_GRID_CONFIG, 0 until then
+	qint64 mLastSentMs;
+	QElapsedTimer mClock; // monotonic, for the failure detector and keep-alives
+	QString mRequestedArchiveHash;
+	qint64 mRequestedArchiveSize;
+	QFile * mArchivePart; // cache/<hash>.zip.part, kept across reconnects to resume
+	qint64 mArchiveResendOffset;
+	bool mArchiveResumed; // the transfer continues a .part left by an earlier one
+	QString mDeltaHash; // archive being requested is a delta of the installed files
+	QStringList mDeltaRemovedFiles;
+	QString mOfferedArchiveHash;
+	NetworkClient * mPeerSource; // worker the archive is fetched from, null while it comes from the manager
+	QTcpSocket * mPeerProbe; // checks the peer answers before the blocking connect
+	QTimer * mPeerStallTimer; // a peer that stops sending is given up on
+	NetworkServer * mPeerServer; // serves cached archives to other workers
+	quint16 mPeerPort;
+	QHash<QString, PeerUpload> mPeerUploads;
+	QByteArray mPendingBatch;
+	int mPendingBatchCount;
+	ComputeGrid::DataPacketType mPendingBatchFirstType;
+	QByteArray mPendingBatchFirstData;
+	QTimer * mBatchTimer;
+	int mBatchMaxBytes;
+	int mBatchLingerMs;
+	bool mManagerBatching; // the manager accepts batches, set by DPT_GRID_CONFIG
+	ComputeGrid::CompressionCodec mCompressionCodec;
+	int mCompressionThreshold;
+	QList<QStringList> mTaskDeque; // tasks waiting for a slot, taskId first; steals take from the back
+	QHash<QString, WorkerProcess *> mRunningTasks;
+	QSet<QString> mCancelledTasks; // running, cancelled by the manager, waiting for worker.exe to let go of them
+	int mTaskSlots; // of all session processes
+	int mPrefetchDepth;
+	bool mWorkStealing;
+	bool mStealRequested;
+	int mStealBackoffMs; // wait before the next steal request after an empty grant, doubles up to StealRetryMaxMs
+	qint64 mCreditWindow;
+	qint64 mCreditOwed; // bytes received from the manager but not granted back yet
+	QString mDataDirectory; // cache, parts and extracted trees of this worker instance
 	QMutex mProcessMutex;
 	QMutex mNetworkMutex;
 
+	static const int StealRetryMs = 500;
+	static const int StealRetryMaxMs = 16000;
+	static const int ArchiveCacheSize = 4;
+	static const int TreeCacheSize = 4; // extracted archives kept
+	static const int PeerConnectTimeOutMs = 3000;
+	static const int PeerStallTimeOutMs = 15000;
+
 #pragma region Signals-Slots
 signals:
 	void workerInGrid();
@@ -51,6 +170,8 @@ signals:
 	void statusMessage(QString _message);
 
 public slots:
+	void processMessageReceived(ComputeGrid::ProcessMessage _message);
+	void processBytesWritten(qint64 _bytes);
 	void processStarted();
 	void processFinished(int _exitCode, QProcess::ExitStatus _exitStatus);
 
@@ -59,7 +180,19 @@ public slots:
 	void networkPacketReceived(NetworkPacket _packet);
 	void networkError(QAbstractSocket::SocketError _socketError);
 
+	void peerSourceConnected();
+	void peerSourceDisconnected();
+	void peerSourceError(QAbstractSocket::SocketError _socketError);
+	void peerSourcePacketReceived(NetworkPacket _packet);
+	void peerProbeConnected();
+	void peerProbeError(QAbstractSocket::SocketError _socketError);
+	void peerStallTimeout();
+	void peerClientDisconnected(NetworkClientInfo _clientInfo);
+	void peerPacketReceived(NetworkClientInfo _clientInfo, NetworkPacket _packet);
+
 	void keepAliveTimerTimeout();
+	void batchTimerTimeout();
+	void stealRetryTimeout();
 #pragma endregion
 
 };